@@ -18,15 +18,19 @@
 
 #include "sboxread.h"
 #include "sboxwrit.h"
+#include "sboxkit.h"
 
 void VerboseListing(char *filename)
 {
    char signature[16];
    uint32 i,n;
    SboxHandle *f;
+   SboxListEntry *list;
+   char *names;
    SboxReadOpenFilename(&f, filename, NULL);
    SboxSignature(signature, f);
    SboxNumItems(&n, f);
+   SboxListNames(&names, &list, f);
 
    printf("FILE SIGNATURE: %16c  [ ", signature);
    for (i=0; i < 16; ++i) {
@@ -35,15 +39,17 @@ void VerboseListing(char *filename)
    printf("]\n\n");
 
    for (i=0; i < n; ++i) {
-      uint32 sz, nsz;
-      char *str;
+      uint32 sz, stored = list[i].size, nsz = list[i].namesize;
+      char *str = names + list[i].name;
       SboxItemSize(&sz, f, i);
-      SboxNameSize(&nsz, f, i);
-      SboxNameData(&str, f, i);
-      printf("%8d  \"%.*s\"\n", sz, nsz, str);
+      if (stored != sz)
+         printf("%8d  \"%.*s\"  (%d stored)\n", sz, nsz, str, stored);
+      else
+         printf("%8d  \"%.*s\"\n", sz, nsz, str);
    }
    printf("%d entries\n", n);
 
+   free(list);
    SboxReadClose(f);
 }
 
@@ -56,7 +62,9 @@ void VerboseListing(char *filename)
 void CopySbox(SboxWriteHandle *out, SboxHandle *in, char *remove, char *rename_from, char *rename_to)
 {
    uint32 i,n;
+   SboxkitCopy *copy;
    SboxNumItems(&n, in);
+   SboxkitCopyBegin(&copy, out, in);
    for (i=0; i < n; ++i) {
       uint32 sz;
       char *str;
@@ -68,22 +76,11 @@ void CopySbox(SboxWriteHandle *out, SboxHandle *in, char *remove, char *rename_f
 
       /* If we're supposed to rename this item, output it with the new name */
       if (strMatch(rename_from, str, sz))
-         SboxWriteStartItemNamed(out, rename_to, strlen(rename_to));
+         SboxkitCopyItem(copy, i, rename_to, strlen(rename_to));
       else
-         SboxWriteStartItemNamed(out, str, sz);
-
-      /* copy the data in an extremely naive way */
-      sz = 0;
-      SboxItemSize(&sz, in, i);
-      if (sz != 0) {
-         str = malloc(sz);
-         if (!str) { fprintf(stderr, "Out of memory.\n"); exit(1); }
-         SboxReadItem(str, sz, in, i, 0);
-         SboxWriteData(out, str, sz);
-         free(str);
-      }
-      SboxWriteEndItem(out);
+         SboxkitCopyItem(copy, i, NULL, 0);
    }
+   SboxkitCopyEnd(copy);
 }
 
 void CreateSbox(char *filename, char *sig)
@@ -151,6 +148,87 @@ void RenameEntry(char *infile, char *old_name, char *new_name, char *outfile)
    SboxReadClose(f);
 }
 
+/*
+ *  rewrite an sbox keeping only the data its items refer to,
+ *  optionally reordering the items by data location
+ */
+void CompactSbox(char *infile, char *outfile, char *order)
+{
+   char signature[16];
+   uint32 n, dead, *ids = NULL;
+   SboxHandle *f;
+   SboxWriteHandle *g;
+   SboxReadOpenFilename(&f, infile, NULL);
+   SboxSignature(signature, f);
+   SboxDeadSpace(&dead, f);
+   if (order != NULL) {
+      if (strcmp(order, "loc")) { fprintf(stderr, "Unknown order '%s'\n", order); exit(1); }
+      SboxNumItems(&n, f);
+      ids = malloc(n * sizeof(ids[0]) + 1);
+      if (!ids) { fprintf(stderr, "Out of memory.\n"); exit(1); }
+      SboxkitOrderByLocation(ids, f);
+   }
+   SboxWriteOpenFilename(&g, outfile, signature);
+   SboxkitCompact(g, f, ids);
+   SboxWriteClose(g);
+   SboxReadClose(f);
+   free(ids);
+   printf("%u bytes of dead space dropped\n", dead);
+}
+
+/*
+ *  check the structure of an sbox and the checksums of its items;
+ *  exits with 1 if anything is wrong
+ */
+void VerifySbox(char *infile, int threads)
+{
+   static char *problem[] = { "ok", "no checksum", "outside the data area",
+                              "overlaps another item", "corrupt" };
+   uint32 i, n, count[5] = { 0 };
+   unsigned char *status;
+   SboxHandle *f;
+   if (SboxReadOpenFilename(&f, infile, NULL) != SBOX_OK) {
+      fprintf(stderr, "%s: not a valid sbox file\n", infile);
+      exit(1);
+   }
+   SboxNumItems(&n, f);
+   status = malloc(n + 1);
+   if (!status) { fprintf(stderr, "Out of memory.\n"); exit(1); }
+   if (SboxkitVerify(status, infile, NULL, threads) != SBOX_OK) {
+      fprintf(stderr, "%s: checking failed\n", infile);
+      exit(1);
+   }
+   for (i=0; i < n; ++i) {
+      uint32 nsz;
+      char *str;
+      ++count[status[i]];
+      if (status[i] <= SBOXKIT_VERIFY_NO_CHECKSUM) continue;
+      SboxNameSize(&nsz, f, i);
+      SboxNameData(&str, f, i);
+      printf("item %d \"%.*s\": %s\n", i, nsz, str, problem[status[i]]);
+   }
+   printf("%d entries, %d checksums verified, %d without checksums, %d bad\n",
+          n, count[0], count[1], n - count[0] - count[1]);
+   SboxReadClose(f);
+   free(status);
+   if (count[0] + count[1] != n) exit(1);
+}
+
+/*
+ *  write an index file for an sbox, which readers can map
+ *  instead of parsing its directory
+ */
+void IndexSbox(char *infile, char *indexfile)
+{
+   SboxHandle *f;
+   SboxReadOpenFilename(&f, infile, NULL);
+   if (SboxReadSaveIndex(f, indexfile) != SBOX_OK) {
+      fprintf(stderr, "writing index '%s' failed\n", indexfile);
+      exit(1);
+   }
+   SboxReadClose(f);
+}
+
 void OutputEntry(char *infile, char *name, char *outfile)
 {
    uint32 i,n;
@@ -170,19 +248,13 @@ void OutputEntry(char *infile, char *name, char *outfile)
       if (strMatch(name, str, sz)) {
          sz = 0;
          SboxItemSize(&sz, f, i);
-         if (sz != 0) {
-            str = malloc(sz);
-            if (!str) { fprintf(stderr, "Out of memory.\n"); exit(1); }
-            SboxReadItem(str, sz, f, i, 0);
-            g = fopen(outfile, "wb");
-            if (!g) { fprintf(stderr, "opening file '%s' for write failed\n", outfile); exit(1); }
-            fwrite(str, 1, sz, g);
-            fclose(g);
-         } else {
-            g = fopen(outfile, "wb");
-            if (!g) { fprintf(stderr, "opening file '%s' for write failed\n", outfile); exit(1); }
-            fclose(g);
+         g = fopen(outfile, "wb");
+         if (!g) { fprintf(stderr, "opening file '%s' for write failed\n", outfile); exit(1); }
+         if (sz != 0 && SboxCopyItemToFd(f, i, 0, sz, fileno(g)) != sz) {
+            fprintf(stderr, "writing file '%s' failed\n", outfile);
+            exit(1);
          }
+         fclose(g);
          return;
       }
    }
@@ -205,13 +277,16 @@ int main(int argc, char **argv)
 
    if (argc < 3) {
      usage:
-      fprintf(stderr, "Usage: box <boxfile> {acdorv} [other parameters]\n"
+      fprintf(stderr, "Usage: box <boxfile> {acdioprtv} [other parameters]\n"
              "  box v boxfile                    list the contents of the boxfile\n"
              "  box c boxfile 16-char-signature  create an empty boxfile\n"
              "  box a boxfile name file1 file2   add the pair(name,file1) to boxfile, output to file2\n"
              "  box d boxfile name file1         delete the first entry containing (name), output to file1\n"
              "  box r boxfile name1 name2 file1  rename the item name1 to the name name2\n"
-             "  box o boxfile name file1         output the data for 'name' to file1\n");
+             "  box i boxfile file1              write an index of boxfile to file1\n"
+             "  box o boxfile name file1         output the data for 'name' to file1\n"
+             "  box p boxfile file1 [loc]        compact boxfile into file1, optionally in data order\n"
+             "  box t boxfile [threads]          check the structure and item checksums of boxfile\n");
       exit(0);
    }
 
@@ -227,8 +302,16 @@ int main(int argc, char **argv)
                 break;
       case 'r': if (argc == 6) RenameEntry(argv[2], argv[3], argv[4], argv[5]); else goto BadParameters;
                 break;
+      case 'i': if (argc == 4) IndexSbox(argv[2], argv[3]); else goto BadParameters;
+                break;
       case 'o': if (argc == 5) OutputEntry(argv[2], argv[3], argv[4]); else goto BadParameters;
                 break;
+      case 'p': if (argc == 4 || argc == 5) CompactSbox(argv[2], argv[3], argc == 5 ? argv[4] : NULL);
+                else goto BadParameters;
+                break;
+      case 't': if (argc == 3 || argc == 4) VerifySbox(argv[2], argc == 4 ? atoi(argv[3]) : 4);
+                else goto BadParameters;
+                break;
    }
    return 0;
 }
@@ -28,6 +28,16 @@ typedef enum
    SBOX_INVALID_ITEM,
 } SboxResultCode;
 
+// how an item's data is stored, so it can be copied to another sbox as
+// is (see SboxWriteStartStoredItem())
+typedef struct
+{
+   uint32 encoding;           // 0 if stored as is, else how it's compressed
+   uint32 size;               // as SboxItemSize()
+   int    has_crc;            // 'crc' is the CRC32C of the data as stored
+   uint32 crc;
+} SboxItemForm;
+
 #ifdef __cplusplus
 }
 #endif
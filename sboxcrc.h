@@ -0,0 +1,12 @@
+#ifndef INCLUDE_SBOXCRC_H
+#define INCLUDE_SBOXCRC_H
+
+#include "sbox.h"
+
+// CRC32C checksums of item data, used by sboxread and sboxwrit; not
+// part of the public API
+
+// continue the checksum 'crc' (0 to start) over 'size' more bytes
+extern uint32 sbox_crc32c(uint32 crc, void *data, uint32 size);
+
+#endif
@@ -0,0 +1,423 @@
+// SBOXD.C
+// sBOX asset server
+
+// Keeps a set of sbox files open, with their directories and name
+// indexes loaded once, and serves their items over a Unix domain
+// socket, so that short-lived processes needn't each open and parse
+// the same archives.
+//
+//     sboxd socketpath [-t threads] boxfile...
+//
+// A client sends any number of requests over one connection, each
+// the length of an item name as a little-endian uint32, followed by
+// the name.  Each request is answered with a little-endian uint32
+// status (SBOXD_FOUND, SBOXD_NOT_FOUND or SBOXD_FAILED) and a uint32
+// size, followed by the 'size' bytes of the item if it was found.
+// The boxfiles are searched in the order given, so earlier ones
+// override later ones.
+//
+// The main thread accepts connections, poll()s them and reads the
+// requests as they arrive, without blocking; each complete request is
+// queued for a fixed pool of threads, and the thread that answers it
+// hands the connection back afterwards.  So a client that stays
+// connected, or sends half a request, holds no thread; a reply that
+// isn't read within SBOXD_TIMEOUT seconds drops the connection.  Each
+// thread reads through clones of the archives of its own, so decoding
+// and sending a compressed item locks out no other thread.  Items are
+// sent with SboxCopyItemToFd(), so uncompressed ones go from the file
+// to the socket inside the kernel.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "sboxread.h"
+#include "sboxthrd.h"
+
+#define SBOXD_FOUND        0
+#define SBOXD_NOT_FOUND    1
+#define SBOXD_FAILED       2
+
+#define SBOXD_MAX_NAME     65536
+#define SBOXD_THREADS      8
+#define SBOXD_TIMEOUT      10
+
+typedef struct
+{
+   char       *filename;
+   SboxHandle *sbox;
+} Archive;
+
+typedef struct
+{
+   int            fd;
+   unsigned char  header[4];     // the name's length
+   unsigned char *name;
+   uint32         name_max;      // room in 'name', once allocated
+   uint32         got;           // bytes of the request read so far
+} Connection;
+
+// a first-in first-out list of connections
+typedef struct
+{
+   Connection **conn;
+   int          first, count, max;  // conn[first..first+count) are in it
+} ConnList;
+
+static Archive *archives;
+static int      num_archives;
+static int      listener;
+
+// connections with a whole request read, and ones handed back by the
+// workers for the main thread to poll() again; a byte written to
+// 'wake' interrupts the poll() to pick those up
+static SboxMutex queue_lock;
+static SboxCond  queue_ready;
+static ConnList  queued, handed_back;
+static int       wake[2];
+
+// the connections being poll()ed, after the listener and 'wake';
+// polls[i] is for polled[i]
+static struct pollfd *polls;
+static Connection   **polled;
+static int            num_polls, max_polls;
+
+static int write_all(int fd, void *data, uint32 size)
+{
+   unsigned char *p = data;
+   while (size) {
+      ssize_t n = write(fd, p, size);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return 0;
+      p += n;
+      size -= n;
+   }
+   return 1;
+}
+
+static void put_little_int(unsigned char *p, uint32 x)
+{
+   p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+#define little_int(x)    (((((uint32) (x)[3])*256+(x)[2])*256+(x)[1])*256+(x)[0])
+
+// answer one request; returns 0 if the connection should be dropped
+static int serve_item(int fd, SboxHandle *sbox, uint32 item)
+{
+   unsigned char header[8];
+   uint32 size, sent;
+
+   if (SboxItemSize(&size, sbox, item) != SBOX_OK) {
+      put_little_int(header, SBOXD_FAILED);
+      put_little_int(header+4, 0);
+      return write_all(fd, header, 8);
+   }
+   put_little_int(header, SBOXD_FOUND);
+   put_little_int(header+4, size);
+   if (!write_all(fd, header, 8)) return 0;
+   if (size == 0) return 1;
+
+   // the client knows the size already, so a short copy can only be
+   // reported by dropping the connection
+   sent = SboxCopyItemToFd(sbox, item, 0, size, fd);
+   return sent == size;
+}
+
+// 'sbox' holds the thread's handle on each archive
+static int serve_request(Connection *c, SboxHandle **sbox)
+{
+   unsigned char header[8];
+   uint32 namesize = little_int(c->header), item;
+   int i;
+
+   item = SBOX_NOT_FOUND;
+   for (i=0; i < num_archives; ++i) {
+      if (SboxFindName(&item, sbox[i], c->name, namesize) == SBOX_OK
+            && item != SBOX_NOT_FOUND)
+         break;
+   }
+   if (i < num_archives)
+      return serve_item(c->fd, sbox[i], item);
+   put_little_int(header, SBOXD_NOT_FOUND);
+   put_little_int(header+4, 0);
+   return write_all(c->fd, header, 8);
+}
+
+static void close_connection(Connection *c)
+{
+   close(c->fd);
+   free(c->name);
+   free(c);
+}
+
+static int add_connection(ConnList *list, Connection *c)
+{
+   if (list->first + list->count == list->max) {
+      if (list->first) {
+         memmove(list->conn, list->conn + list->first, list->count * sizeof(c));
+         list->first = 0;
+      } else {
+         int max = list->max ? list->max * 2 : 64;
+         Connection **p = realloc(list->conn, max * sizeof(c));
+         if (p == NULL) return 0;
+         list->conn = p;
+         list->max  = max;
+      }
+   }
+   list->conn[list->first + list->count++] = c;
+   return 1;
+}
+
+static Connection *take_connection(ConnList *list)
+{
+   Connection *c = list->conn[list->first++];
+   if (--list->count == 0) list->first = 0;
+   return c;
+}
+
+SBOX_THREAD(worker, arg)
+{
+   SboxHandle **sbox = arg;
+   Connection *c;
+   int ok;
+   for (;;) {
+      sbox_mutex_lock(&queue_lock);
+      while (queued.count == 0)
+         sbox_cond_wait(&queue_ready, &queue_lock);
+      c = take_connection(&queued);
+      sbox_mutex_unlock(&queue_lock);
+
+      if (serve_request(c, sbox)) {
+         c->got = 0;
+         sbox_mutex_lock(&queue_lock);
+         ok = add_connection(&handed_back, c);
+         sbox_mutex_unlock(&queue_lock);
+         // if the pipe is full, the main thread is due to wake anyway
+         if (ok) { (void) !write(wake[1], "", 1); continue; }
+      }
+      close_connection(c);
+   }
+   return 0;
+}
+
+static void add_poll(int fd, Connection *c)
+{
+   if (num_polls == max_polls) {
+      int max = max_polls ? max_polls * 2 : 64;
+      struct pollfd *p = realloc(polls, max * sizeof(polls[0]));
+      Connection **q;
+      if (p != NULL) polls = p;
+      q = realloc(polled, max * sizeof(polled[0]));
+      if (p == NULL || q == NULL) { fprintf(stderr, "Out of memory.\n"); exit(1); }
+      polled = q;
+      max_polls = max;
+   }
+   polls[num_polls].fd = fd;
+   polls[num_polls].events = POLLIN;
+   polls[num_polls].revents = 0;
+   polled[num_polls++] = c;
+}
+
+// read what has arrived of the request on 'c'; returns 1 once it's
+// all there, -1 if the connection should be dropped, else 0
+static int read_request(Connection *c)
+{
+   uint32 namesize;
+   ssize_t n;
+
+   for (;;) {
+      if (c->got < 4) {
+         n = recv(c->fd, c->header + c->got, 4 - c->got, MSG_DONTWAIT);
+      } else {
+         namesize = little_int(c->header);
+         if (namesize > SBOXD_MAX_NAME) return -1;
+         if (c->got == 4 + namesize) return 1;
+         if (c->name == NULL || namesize > c->name_max) {
+            unsigned char *p = realloc(c->name, namesize + 1);
+            if (p == NULL) return -1;
+            c->name = p;
+            c->name_max = namesize;
+         }
+         n = recv(c->fd, c->name + c->got - 4, 4 + namesize - c->got, MSG_DONTWAIT);
+      }
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+      if (n <= 0) return -1;
+      c->got += n;
+   }
+}
+
+static void accept_connection(void)
+{
+   struct timeval timeout;
+   Connection *c;
+   int fd = accept(listener, NULL, NULL);
+
+   if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN
+                         || errno == EWOULDBLOCK)
+         return;
+      perror("sboxd: accept");
+      exit(1);
+   }
+   c = malloc(sizeof(*c));
+   if (c == NULL) { close(fd); return; }
+   c->fd = fd;
+   c->name = NULL;
+   c->name_max = 0;
+   c->got = 0;
+   // some systems pass the listener's O_NONBLOCK on, but the workers
+   // write with blocking calls, bounded by the timeout
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+   timeout.tv_sec  = SBOXD_TIMEOUT;
+   timeout.tv_usec = 0;
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+   add_poll(fd, c);
+}
+
+// poll() the listener and the idle connections for good, queueing
+// each connection whose request has arrived for the workers
+static void dispatch(void)
+{
+   unsigned char drain[256];
+   Connection *c;
+   int i, r;
+
+   add_poll(listener, NULL);
+   add_poll(wake[0], NULL);
+   for (;;) {
+      if (poll(polls, num_polls, -1) < 0) {
+         if (errno == EINTR) continue;
+         perror("sboxd: poll");
+         exit(1);
+      }
+
+      if (polls[1].revents) {
+         while (read(wake[0], drain, sizeof(drain)) > 0)
+            ;
+      }
+      for (i=num_polls-1; i >= 2; --i) {
+         if (polls[i].revents == 0) continue;
+         c = polled[i];
+         r = read_request(c);
+         if (r == 0) continue;
+         if (r > 0) {
+            sbox_mutex_lock(&queue_lock);
+            r = add_connection(&queued, c);
+            sbox_cond_signal(&queue_ready);
+            sbox_mutex_unlock(&queue_lock);
+         }
+         if (r <= 0)
+            close_connection(c);
+         polls[i]  = polls[--num_polls];
+         polled[i] = polled[num_polls];
+      }
+      sbox_mutex_lock(&queue_lock);
+      while (handed_back.count) {
+         c = take_connection(&handed_back);
+         add_poll(c->fd, c);
+      }
+      sbox_mutex_unlock(&queue_lock);
+
+      if (polls[0].revents)
+         accept_connection();
+   }
+}
+
+static void open_archive(Archive *a, char *filename)
+{
+   int fd = open(filename, O_RDONLY);
+   a->filename = filename;
+   // each thread's clone dup()s the descriptor and reads it with pread()
+   if (fd < 0 || SboxReadOpenIO(&a->sbox, SboxIOFd(fd, 1), 1, NULL) != SBOX_OK) {
+      fprintf(stderr, "sboxd: can't open sbox '%s' (error %d)\n",
+                      filename, sbox_read_error_code);
+      exit(1);
+   }
+   if (SboxReadSetNameIndex(a->sbox, 1) != SBOX_OK) {
+      fprintf(stderr, "sboxd: can't index sbox '%s'\n", filename);
+      exit(1);
+   }
+}
+
+int main(int argc, char **argv)
+{
+   struct sockaddr_un addr;
+   SboxThread thread;
+   int i, j, first = 2, threads = SBOXD_THREADS;
+
+   if (argc > 3 && !strcmp(argv[2], "-t")) {
+      threads = atoi(argv[3]);
+      first = 4;
+   }
+   if (argc <= first || threads < 1) {
+      fprintf(stderr, "Usage: sboxd socketpath [-t threads] boxfile...\n");
+      exit(1);
+   }
+
+   // names are looked up by every thread, so the directories must be
+   // in memory rather than read through a shared buffer
+   sbox_max_memory_directory = SBOX_DIRECTORY_ALWAYS_IN_MEMORY;
+   num_archives = argc - first;
+   archives = malloc(num_archives * sizeof(archives[0]));
+   if (archives == NULL) { fprintf(stderr, "Out of memory.\n"); exit(1); }
+   for (i=0; i < num_archives; ++i)
+      open_archive(&archives[i], argv[first+i]);
+
+   // a client hanging up shouldn't kill the server
+   signal(SIGPIPE, SIG_IGN);
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "sboxd: socket path too long\n");
+      exit(1);
+   }
+   strcpy(addr.sun_path, argv[1]);
+   unlink(argv[1]);
+   listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0
+                    || listen(listener, 64) != 0) {
+      perror("sboxd");
+      exit(1);
+   }
+
+   // the listener and the wake pipe mustn't block the main thread
+   if (pipe(wake) != 0) {
+      perror("sboxd");
+      exit(1);
+   }
+   fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+   fcntl(wake[0], F_SETFL, fcntl(wake[0], F_GETFL) | O_NONBLOCK);
+   fcntl(wake[1], F_SETFL, fcntl(wake[1], F_GETFL) | O_NONBLOCK);
+   sbox_mutex_init(&queue_lock);
+   sbox_cond_init(&queue_ready);
+
+   // each thread gets clones of its own, made here before any thread
+   // reads the archives
+   for (i=0; i < threads; ++i) {
+      SboxHandle **clone = malloc(num_archives * sizeof(clone[0]));
+      if (clone == NULL) { fprintf(stderr, "Out of memory.\n"); exit(1); }
+      for (j=0; j < num_archives; ++j) {
+         if (SboxReadClone(&clone[j], archives[j].sbox) != SBOX_OK) {
+            fprintf(stderr, "sboxd: can't clone sbox '%s'\n", archives[j].filename);
+            exit(1);
+         }
+      }
+      if (sbox_thread_create(&thread, worker, clone)) {
+         fprintf(stderr, "sboxd: can't start threads\n");
+         exit(1);
+      }
+   }
+   dispatch();
+   return 0;
+}
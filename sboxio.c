@@ -0,0 +1,424 @@
+// sboxio.c
+//    I/O backends for sboxread and sboxwrit
+//
+// Each backend is a struct starting with an SboxIO.  All of them read
+// and write at explicit offsets; the writer still writes the stdio
+// backend sequentially through its FILE * (see sboxwrit.c).
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>        // _chsize
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "sboxio.h"
+#include "sboxthrd.h"
+
+#define min(x,y)    ((x) < (y) ? (x) : (y))
+
+#ifdef __linux__
+// move bytes from one descriptor to another inside the kernel:
+// copy_file_range() between regular files, which may share extents or
+// copy on the server, and sendfile() to anything else, like a socket
+static uint32 kernel_send(int in, uint32 offset, uint32 size, int out)
+{
+   struct stat st;
+   off_t soff = offset;
+   uint32 done = 0;
+   int use_sendfile = fstat(out, &st) != 0 || !S_ISREG(st.st_mode);
+
+   while (done < size) {
+      ssize_t n;
+      if (!use_sendfile) {
+         n = copy_file_range(in, &soff, out, NULL, size-done, 0);
+         if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                                       || errno == EOPNOTSUPP)) {
+            use_sendfile = 1;
+            continue;
+         }
+      } else
+         n = sendfile(out, in, &soff, size-done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      done += n;
+   }
+   return done;
+}
+#endif
+
+/////
+//
+// stdio
+//
+
+typedef struct
+{
+   SboxIO io;
+   int    close;
+} SboxIOStdioFile;
+
+static uint32 stdio_read(SboxIO *io, uint32 offset, void *data, uint32 size)
+{
+   if (fseek(io->f, offset, SEEK_SET) != 0) return 0;
+   return fread(data, 1, size, io->f);
+}
+
+static uint32 stdio_write(SboxIO *io, uint32 offset, void *data, uint32 size)
+{
+   if (fseek(io->f, offset, SEEK_SET) != 0) return 0;
+   return fwrite(data, 1, size, io->f);
+}
+
+static uint32 stdio_size(SboxIO *io)
+{
+   long here = ftell(io->f), size;
+   if (fseek(io->f, 0, SEEK_END) != 0) return 0;
+   size = ftell(io->f);
+   fseek(io->f, here, SEEK_SET);
+   return size < 0 ? 0 : size;
+}
+
+static int stdio_truncate(SboxIO *io, uint32 size)
+{
+   if (fflush(io->f) != 0) return 1;
+#ifdef _WIN32
+   return _chsize(_fileno(io->f), size);
+#else
+   return ftruncate(fileno(io->f), size);
+#endif
+}
+
+#ifdef __linux__
+static uint32 stdio_send(SboxIO *io, uint32 offset, uint32 size, int fd)
+{
+   return kernel_send(fileno(io->f), offset, size, fd);
+}
+#endif
+
+#ifndef _WIN32
+static SboxIO *stdio_reopen(SboxIO *io)
+{
+   int fd = dup(fileno(io->f));
+   SboxIO *copy;
+   if (fd < 0) return NULL;
+   copy = SboxIOFd(fd, 1);
+   if (copy == NULL) close(fd);
+   return copy;
+}
+#endif
+
+static void stdio_close(SboxIO *io)
+{
+   if (((SboxIOStdioFile *) io)->close)
+      fclose(io->f);
+   free(io);
+}
+
+SboxIO *SboxIOStdio(FILE *f, int close)
+{
+   SboxIOStdioFile *s;
+   if (f == NULL) return NULL;
+   s = calloc(1, sizeof(*s));
+   if (s == NULL) return NULL;
+   s->io.read     = stdio_read;
+   s->io.write    = stdio_write;
+   s->io.size     = stdio_size;
+   s->io.truncate = stdio_truncate;
+   s->io.close    = stdio_close;
+#ifdef __linux__
+   s->io.send     = stdio_send;
+#endif
+#ifndef _WIN32
+   s->io.reopen   = stdio_reopen;
+#endif
+   s->io.f        = f;
+   s->close       = close;
+   return &s->io;
+}
+
+/////
+//
+// file descriptors
+//
+
+#ifndef _WIN32
+
+typedef struct
+{
+   SboxIO io;
+   int    fd;
+   int    close;
+} SboxIOFdFile;
+
+static uint32 fd_read(SboxIO *io, uint32 offset, void *data, uint32 size)
+{
+   int fd = ((SboxIOFdFile *) io)->fd;
+   unsigned char *p = data;
+   uint32 done = 0;
+   while (done < size) {
+      ssize_t n = pread(fd, p + done, size - done, (off_t) offset + done);
+      if (n <= 0) break;
+      done += n;
+   }
+   return done;
+}
+
+static uint32 fd_write(SboxIO *io, uint32 offset, void *data, uint32 size)
+{
+   int fd = ((SboxIOFdFile *) io)->fd;
+   unsigned char *p = data;
+   uint32 done = 0;
+   while (done < size) {
+      ssize_t n = pwrite(fd, p + done, size - done, (off_t) offset + done);
+      if (n <= 0) break;
+      done += n;
+   }
+   return done;
+}
+
+static uint32 fd_size(SboxIO *io)
+{
+   struct stat st;
+   if (fstat(((SboxIOFdFile *) io)->fd, &st) != 0) return 0;
+   return (uint32) st.st_size;
+}
+
+static int fd_truncate(SboxIO *io, uint32 size)
+{
+   return ftruncate(((SboxIOFdFile *) io)->fd, size);
+}
+
+#ifdef __linux__
+static uint32 fd_send(SboxIO *io, uint32 offset, uint32 size, int fd)
+{
+   return kernel_send(((SboxIOFdFile *) io)->fd, offset, size, fd);
+}
+#endif
+
+static SboxIO *fd_reopen(SboxIO *io)
+{
+   int fd = dup(((SboxIOFdFile *) io)->fd);
+   SboxIO *copy;
+   if (fd < 0) return NULL;
+   copy = SboxIOFd(fd, 1);
+   if (copy == NULL) close(fd);
+   return copy;
+}
+
+static void fd_close(SboxIO *io)
+{
+   SboxIOFdFile *s = (SboxIOFdFile *) io;
+   if (s->close)
+      close(s->fd);
+   free(s);
+}
+
+#endif
+
+SboxIO *SboxIOFd(int fd, int close)
+{
+#ifdef _WIN32
+   return NULL;
+#else
+   SboxIOFdFile *s;
+   if (fd < 0) return NULL;
+   s = calloc(1, sizeof(*s));
+   if (s == NULL) return NULL;
+   s->io.read     = fd_read;
+   s->io.write    = fd_write;
+   s->io.size     = fd_size;
+   s->io.truncate = fd_truncate;
+   s->io.close    = fd_close;
+#ifdef __linux__
+   s->io.send     = fd_send;
+#endif
+   s->io.reopen   = fd_reopen;
+   s->fd          = fd;
+   s->close       = close;
+   return &s->io;
+#endif
+}
+
+/////
+//
+// memory, and files mapped into it
+//
+
+typedef struct
+{
+   SboxIO io;
+   unsigned char *data;
+   uint32 size;
+   uint32 max;                         // bytes allocated, if growable
+   int    growable;
+   int    mapped;                      // 'data' is an mmap() of the file
+   SboxMutex lock;                     // guards growth
+} SboxIOMemoryFile;
+
+static uint32 memory_read(SboxIO *io, uint32 offset, void *data, uint32 size)
+{
+   SboxIOMemoryFile *m = (SboxIOMemoryFile *) io;
+   if (m->growable) sbox_mutex_lock(&m->lock);
+   if (offset >= m->size)
+      size = 0;
+   else {
+      size = min(size, m->size - offset);
+      memcpy(data, m->data + offset, size);
+   }
+   if (m->growable) sbox_mutex_unlock(&m->lock);
+   return size;
+}
+
+static uint32 memory_write(SboxIO *io, uint32 offset, void *data, uint32 size)
+{
+   SboxIOMemoryFile *m = (SboxIOMemoryFile *) io;
+   uint32 end = offset + size;
+
+   if (end < offset) return 0;
+   sbox_mutex_lock(&m->lock);
+   if (end > m->max) {
+      uint32 max = m->max ? m->max : 65536;
+      unsigned char *p;
+      while (max < end && max * 2 > max) max *= 2;
+      if (max < end) max = end;
+      p = realloc(m->data, max);
+      if (p == NULL) {
+         sbox_mutex_unlock(&m->lock);
+         return 0;
+      }
+      m->data = p;
+      m->max  = max;
+   }
+   if (offset > m->size)
+      memset(m->data + m->size, 0, offset - m->size);
+   memcpy(m->data + offset, data, size);
+   if (end > m->size) m->size = end;
+   sbox_mutex_unlock(&m->lock);
+   return size;
+}
+
+static uint32 memory_size(SboxIO *io)
+{
+   return ((SboxIOMemoryFile *) io)->size;
+}
+
+static int memory_truncate(SboxIO *io, uint32 size)
+{
+   SboxIOMemoryFile *m = (SboxIOMemoryFile *) io;
+   sbox_mutex_lock(&m->lock);
+   if (size < m->size) m->size = size;
+   sbox_mutex_unlock(&m->lock);
+   return 0;
+}
+
+static void memory_close(SboxIO *io)
+{
+   SboxIOMemoryFile *m = (SboxIOMemoryFile *) io;
+#ifndef _WIN32
+   if (m->mapped && m->size != 0)
+      munmap(m->data, m->size);
+#endif
+   if (m->growable) {
+      free(m->data);
+      sbox_mutex_destroy(&m->lock);
+   }
+   free(m);
+}
+
+// the copy doesn't own the memory, so it must be closed first
+static SboxIO *memory_reopen(SboxIO *io)
+{
+   SboxIOMemoryFile *m = (SboxIOMemoryFile *) io;
+   if (m->growable || m->data == NULL) return NULL;
+   return SboxIOMemory(m->data, m->size);
+}
+
+static SboxIOMemoryFile *memory_new(void)
+{
+   SboxIOMemoryFile *m = calloc(1, sizeof(*m));
+   if (m == NULL) return NULL;
+   m->io.read   = memory_read;
+   m->io.size   = memory_size;
+   m->io.close  = memory_close;
+   m->io.reopen = memory_reopen;
+   return m;
+}
+
+SboxIO *SboxIOMemory(void *data, uint32 size)
+{
+   SboxIOMemoryFile *m = memory_new();
+   if (m == NULL) return NULL;
+   if (data != NULL) {
+      m->data   = data;
+      m->size   = size;
+      m->io.map = data;
+   } else {
+      // the buffer moves as it grows, so it can't be 'map'
+      m->growable    = 1;
+      m->io.write    = memory_write;
+      m->io.truncate = memory_truncate;
+      sbox_mutex_init(&m->lock);
+   }
+   return &m->io;
+}
+
+void *SboxIOMemoryData(SboxIO *io, uint32 *size)
+{
+   SboxIOMemoryFile *m = (SboxIOMemoryFile *) io;
+   *size = m->size;
+   return m->data;
+}
+
+SboxIO *SboxIOMapFile(char *filename)
+{
+#ifdef _WIN32
+   return NULL;
+#else
+   SboxIOMemoryFile *m;
+   struct stat st;
+   void *p = NULL;
+   int fd;
+
+   fd = open(filename, O_RDONLY);
+   if (fd < 0) return NULL;
+   if (fstat(fd, &st) != 0 || st.st_size > 0xffffffff) {
+      close(fd);
+      return NULL;
+   }
+   if (st.st_size != 0) {
+      p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+         close(fd);
+         return NULL;
+      }
+   }
+   close(fd);
+
+   m = memory_new();
+   if (m == NULL) {
+      if (p) munmap(p, st.st_size);
+      return NULL;
+   }
+   m->data   = p;
+   m->size   = (uint32) st.st_size;
+   m->mapped = 1;
+   m->io.map = p;
+   return &m->io;
+#endif
+}
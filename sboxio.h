@@ -0,0 +1,67 @@
+#ifndef INCLUDE_SBOXIO_H      // NOT_IN_SBOXLIB
+#define INCLUDE_SBOXIO_H      // NOT_IN_SBOXLIB
+
+#include <stdio.h>            // NOT_IN_SBOXLIB
+#include "sbox.h"             // NOT_IN_SBOXLIB
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/////////////////////////////////////////////////////////////////////////
+//
+//  I/O backends
+//
+//    sboxread and sboxwrit do all their I/O through an SboxIO.  A
+//    backend is a struct starting with an SboxIO, followed by whatever
+//    state it needs; clients can supply their own.
+
+typedef struct st_SboxIO SboxIO;
+
+struct st_SboxIO
+{
+   // read or write up to 'size' bytes at byte 'offset', returning how
+   // many were transferred; 'write' is NULL for read-only backends, and
+   // must allow calls from several threads at once for concurrent mode
+   uint32 (*read    )(SboxIO *io, uint32 offset, void *data, uint32 size);
+   uint32 (*write   )(SboxIO *io, uint32 offset, void *data, uint32 size);
+   uint32 (*size    )(SboxIO *io);
+   int    (*truncate)(SboxIO *io, uint32 size);   // 0 on success; may be NULL
+   void   (*close   )(SboxIO *io);                // releases the backend
+
+   // move up to 'size' bytes at 'offset' to the file descriptor 'fd'
+   // without passing them through user space, returning how many were
+   // moved; may be NULL
+   uint32 (*send    )(SboxIO *io, uint32 offset, uint32 size, int fd);
+
+   // a new backend onto the same data, with its own file position, to
+   // be used alongside this one in another thread; may be NULL
+   SboxIO *(*reopen )(SboxIO *io);
+
+   FILE   *f;                 // stdio backend only: written sequentially
+   unsigned char *map;        // all the data, if it's in memory already
+};
+
+// a FILE *, fclose()d on close if 'close' is true
+extern SboxIO *SboxIOStdio(FILE *f, int close);
+
+// a file descriptor, read and written with pread() and pwrite(), so
+// readers in many threads don't contend for a file position (not on
+// Windows, where it returns NULL)
+extern SboxIO *SboxIOFd(int fd, int close);
+
+// the whole of a file mapped read-only into memory (not on Windows)
+extern SboxIO *SboxIOMapFile(char *filename);
+
+// 'size' bytes of memory, read-only; if 'data' is NULL, an empty buffer
+// instead, which grows as it's written and is freed on close
+extern SboxIO *SboxIOMemory(void *data, uint32 size);
+
+// where a memory backend's data currently is, and how big it is
+extern void   *SboxIOMemoryData(SboxIO *io, uint32 *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif                // NOT_IN_SBOXLIB
@@ -2,13 +2,24 @@
 //    toolkit over core sboxlib
 //    see sboxkit.h for usage documentation
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE            // copy_file_range()
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#endif
+
 #include "sbox.h"
 #include "sboxread.h"
 #include "sboxwrit.h"
 #include "sboxkit.h"
+#include "sboxthrd.h"
 
 ////////////////////////////////////////////////////////////////////////////
 //
@@ -30,16 +41,10 @@ uint32 SboxkitFindName(SboxHandle *sbox, void *name, uint32 namelen)
          return cache;
    }
 
-   for (i=0; i < n; ++i) {
-      if (SboxkitNameSize(sbox, i) == namelen) {
-         p = SboxkitNameData(sbox, i);
-         if (p && memcmp(p, name, namelen)==0) {
-            cache = i;
-            return i;
-         }
-      }
-   }
-   return SBOXKIT_NOTFOUND;
+   if (SboxFindName(&i, sbox, name, namelen) != SBOX_OK || i == SBOX_NOT_FOUND)
+      return SBOXKIT_NOTFOUND;
+   cache = i;
+   return i;
 }
 
 uint32 SboxkitFindString(SboxHandle *sbox, char *str)
@@ -213,6 +218,444 @@ SboxResultCode SboxkitStringPut(SboxWriteHandle *h, char *name,
    return result;
 }
 
+////////////////////////////////////////////////////////////////////////////
+//
+//  copying items between sbox files, and compaction
+//
+
+#define SBOXKIT_COPY_BUFFER   65536
+
+#ifndef min
+#define min(x,y) ((x) < (y) ? (x) : (y))
+#endif
+
+#ifdef __linux__
+// move 'size' bytes from the current position of 'src' to the current
+// position of 'dest' inside the kernel; returns how many bytes were
+// moved, which is less than 'size' if the kernel couldn't do it all
+static uint32 copy_extents(FILE *dest, FILE *src, uint32 size)
+{
+   off_t soff, doff;
+   uint32 done = 0;
+   int use_sendfile = 0;
+
+   if (fflush(dest) != 0) return 0;
+   soff = ftell(src);
+   doff = ftell(dest);
+   if (soff < 0 || doff < 0) return 0;
+
+   while (done < size) {
+      ssize_t n;
+      if (!use_sendfile) {
+         n = copy_file_range(fileno(src), &soff, fileno(dest), &doff, size-done, 0);
+         if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL)) {
+            // e.g. across filesystems on older kernels; sendfile writes
+            // at the descriptor position, so put it where we want it
+            if (lseek(fileno(dest), doff, SEEK_SET) < 0) break;
+            use_sendfile = 1;
+            continue;
+         }
+      } else {
+         n = sendfile(fileno(dest), fileno(src), &soff, size-done);
+         if (n > 0) doff += n;
+      }
+      if (n <= 0) break;
+      done += n;
+   }
+
+   // resynchronize stdio with what the kernel did behind its back
+   fseek(dest, doff, SEEK_SET);
+   fseek(src , soff, SEEK_SET);
+   return done;
+}
+#endif
+
+// move the first 'size' bytes of item 'item' of 'in', decoded or as
+// stored, into the item being written to 'out'; with 'kernel', they may
+// be copied inside the kernel, behind the writer's back
+static SboxResultCode copy_data(SboxWriteHandle *out, SboxHandle *in, uint32 item,
+                                uint32 size, int stored, int kernel)
+{
+   SboxResultCode result = SBOX_OK;
+   unsigned char *buffer;
+   uint32 done=0;
+
+   if (size == 0)         return SBOX_OK;
+
+#ifdef __linux__
+   // backends other than stdio have no FILE * to copy between
+   if (kernel && SboxFileHandle(in) && SboxWriteFileHandle(out)) {
+      result = SboxSeekItem(in, item, 0);
+      if (result != SBOX_OK) return result;
+      done = copy_extents(SboxWriteFileHandle(out), SboxFileHandle(in), size);
+      if (done == size)   return SBOX_OK;
+   }
+#endif
+
+   // stream whatever is left through a bounded buffer
+   buffer = malloc(min(size-done, SBOXKIT_COPY_BUFFER));
+   if (buffer == NULL)    return SBOX_OUT_OF_MEMORY;
+   while (done < size) {
+      uint32 n = min(size-done, SBOXKIT_COPY_BUFFER);
+      if ((stored ? SboxReadStored(buffer, n, in, item, done)
+                  : SboxReadItem  (buffer, n, in, item, done)) != n) {
+         result = SBOX_INVALID_ITEM;
+         break;
+      }
+      result = SboxWriteData(out, buffer, n);
+      if (result != SBOX_OK) break;
+      done += n;
+   }
+   free(buffer);
+   return result;
+}
+
+// copy the data of item 'item' in 'in' into the item currently
+// being written to 'out', without staging the whole item in memory
+SboxResultCode SboxkitCopyItemData(SboxWriteHandle *out, SboxHandle *in, uint32 item)
+{
+   SboxResultCode result;
+   uint32 size, packed;
+
+   result = SboxItemSize(&size, in, item);
+   if (result == SBOX_OK)
+      result = SboxItemPacked(&packed, in, item);
+   if (result != SBOX_OK) return result;
+
+   // compressed items have to be decompressed, and data copied behind
+   // the writer's back can't be compressed or checksummed
+   return copy_data(out, in, item, size, 0, !packed && !SboxWriteCompression(out)
+                                                    && !SboxWriteChecksums(out));
+}
+
+// where the data at a location of the source went in the output
+typedef struct
+{
+   uint32 from;                        // SboxItemLoc() in 'in'
+   uint32 size;                        // stored size; 0 for an empty slot
+   uint32 to;                          // SboxWriteItemLoc() in 'out'
+} SboxkitShared;
+
+struct st_SboxkitCopy
+{
+   SboxWriteHandle *out;
+   SboxHandle *in;
+   SboxkitShared *table;               // open addressing on 'from'
+   uint32 count;
+   uint32 max;                         // power of two
+};
+
+SboxResultCode SboxkitCopyBegin(SboxkitCopy **copy, SboxWriteHandle *out, SboxHandle *in)
+{
+   *copy = calloc(1, sizeof(**copy));
+   if (*copy == NULL)     return SBOX_OUT_OF_MEMORY;
+   (*copy)->out = out;
+   (*copy)->in  = in;
+   return SBOX_OK;
+}
+
+SboxResultCode SboxkitCopyEnd(SboxkitCopy *copy)
+{
+   free(copy->table);
+   free(copy);
+   return SBOX_OK;
+}
+
+static SboxkitShared *shared_slot(SboxkitShared *table, uint32 max,
+                                  uint32 from, uint32 size)
+{
+   uint32 j = (from * 2654435761u) & (max-1);
+   while (table[j].size != 0 && (table[j].from != from || table[j].size != size))
+      j = (j+1) & (max-1);
+   return &table[j];
+}
+
+static int shared_grow(SboxkitCopy *copy)
+{
+   SboxkitShared *table;
+   uint32 i, max = copy->max ? copy->max * 2 : 1024;
+
+   table = calloc(max, sizeof(table[0]));
+   if (!table) return 1;
+   for (i=0; i < copy->max; ++i)
+      if (copy->table[i].size != 0)
+         *shared_slot(table, max, copy->table[i].from, copy->table[i].size) = copy->table[i];
+   free(copy->table);
+   copy->table = table;
+   copy->max   = max;
+   return 0;
+}
+
+SboxResultCode SboxkitCopyItem(SboxkitCopy *copy, uint32 item, char *name, int namesize)
+{
+   SboxResultCode result;
+   SboxkitShared *slot = NULL;
+   SboxItemForm form;
+   uint32 from, size, n;
+   void *p;
+
+   result = SboxItemStoredForm(&form, copy->in, item);
+   if (result == SBOX_OK)
+      result = SboxItemStoredSize(&size, copy->in, item);
+   if (result == SBOX_OK)
+      result = SboxItemLoc(&from, copy->in, item);
+   if (result == SBOX_OK && name == NULL) {
+      result = SboxNameSize(&n, copy->in, item);
+      if (result == SBOX_OK)
+         result = SboxNameData(&p, copy->in, item);
+      if (result == SBOX_OK) {
+         name     = p;
+         namesize = n;
+      }
+   }
+   if (result != SBOX_OK) return result;
+
+   // data already copied for an earlier item is shared again
+   if (size != 0) {
+      if (copy->count*2 >= copy->max && shared_grow(copy))
+         return SBOX_OUT_OF_MEMORY;
+      slot = shared_slot(copy->table, copy->max, from, size);
+      if (slot->size != 0)
+         return SboxWriteSharedItem(copy->out, name, namesize, slot->to, size, &form);
+   }
+
+   // without a checksum to carry over, the writer has to see the data
+   // to compute one
+   result = SboxWriteStartStoredItem(copy->out, name, namesize, &form);
+   if (result == SBOX_OK)
+      result = copy_data(copy->out, copy->in, item, size, 1,
+                         form.has_crc || !SboxWriteChecksums(copy->out));
+   if (result == SBOX_OK)
+      result = SboxWriteEndItem(copy->out);
+   if (result != SBOX_OK || slot == NULL) return result;
+
+   result = SboxWriteItemLoc(&slot->to, copy->out);
+   if (result != SBOX_OK) return result;
+   slot->from = from;
+   slot->size = size;
+   ++copy->count;
+   return SBOX_OK;
+}
+
+// copy the items of 'in' to 'out' in the order given by 'order' (an
+// array of SboxkitNumItems(in) item ids), or in directory order if
+// 'order' is NULL; only the data referenced by items is carried over
+SboxResultCode SboxkitCompact(SboxWriteHandle *out, SboxHandle *in, uint32 *order)
+{
+   SboxResultCode result;
+   SboxkitCopy *copy;
+   uint32 k,n;
+
+   result = SboxNumItems(&n, in);
+   if (result == SBOX_OK)
+      result = SboxkitCopyBegin(&copy, out, in);
+   if (result != SBOX_OK) return result;
+
+   for (k=0; k < n && result == SBOX_OK; ++k)
+      result = SboxkitCopyItem(copy, order ? order[k] : k, NULL, 0);
+   SboxkitCopyEnd(copy);
+   return result;
+}
+
+typedef struct
+{
+   uint32 offset;
+   uint32 item;
+} SboxkitPlace;
+
+static int place_compare(const void *p, const void *q)
+{
+   const SboxkitPlace *a = p, *b = q;
+   if (a->offset != b->offset) return a->offset < b->offset ? -1 : 1;
+   // keep duplicates in directory order
+   return a->item < b->item ? -1 : 1;
+}
+
+// fill 'order' (SboxkitNumItems(sbox) entries) with the item ids
+// sorted by data location, so copying them reads the file sequentially
+SboxResultCode SboxkitOrderByLocation(uint32 *order, SboxHandle *sbox)
+{
+   SboxResultCode result;
+   SboxkitPlace *place;
+   uint32 i,n;
+
+   result = SboxNumItems(&n, sbox);
+   if (result != SBOX_OK) return result;
+   if (n == 0)            return SBOX_OK;
+
+   place = malloc(n * sizeof(place[0]));
+   if (place == NULL)     return SBOX_OUT_OF_MEMORY;
+   for (i=0; i < n; ++i) {
+      place[i].item = i;
+      result = SboxItemLoc(&place[i].offset, sbox, i);
+      if (result != SBOX_OK) break;
+   }
+   if (result == SBOX_OK) {
+      qsort(place, n, sizeof(place[0]), place_compare);
+      for (i=0; i < n; ++i)
+         order[i] = place[i].item;
+   }
+   free(place);
+   return result;
+}
+
+////////////////////////////////////////////////////////////////////////////
+//
+//  integrity checking
+//
+// Every item is checked against the file layout first.  Then the items
+// are sorted by location and handed out to the threads in batches of
+// consecutive items, so each thread reads a run of the file front to
+// back, through its own handle and a large stdio buffer.
+
+#define SBOXKIT_VERIFY_BATCH     (8 << 20)     // bytes of items per batch
+#define SBOXKIT_VERIFY_BUFFER    (1 << 20)     // stdio buffer per thread
+#define SBOXKIT_VERIFY_THREADS   64
+
+typedef struct
+{
+   char   *filename;
+   char   *sig;
+   unsigned char *status;              // SBOXKIT_VERIFY_* per item
+   uint32 *order;                      // item ids by location
+   uint32 *size;                       // stored size per item
+   uint32 n;
+   uint32 next;                        // next entry of 'order' to hand out
+   SboxResultCode result;              // a thread couldn't open the file
+   SboxMutex lock;
+} SboxkitVerifyJob;
+
+// hand out the next batch of entries of 'order'; returns how many
+static uint32 verify_take(SboxkitVerifyJob *job, uint32 *first)
+{
+   uint32 k, bytes = 0;
+   sbox_mutex_lock(&job->lock);
+   *first = k = job->next;
+   while (k < job->n && bytes < SBOXKIT_VERIFY_BATCH)
+      bytes += job->size[job->order[k++]];
+   job->next = k;
+   sbox_mutex_unlock(&job->lock);
+   return k - *first;
+}
+
+SBOX_THREAD(verify_thread, arg)
+{
+   SboxkitVerifyJob *job = arg;
+   SboxResultCode result;
+   SboxHandle *sbox;
+   uint32 first, count, k, checked;
+   FILE *f;
+
+   f = fopen(job->filename, "rb");
+   if (f != NULL)
+      setvbuf(f, NULL, _IOFBF, SBOXKIT_VERIFY_BUFFER);
+   result = SboxReadOpenFromFile(&sbox, f, 1, job->sig);
+   if (result != SBOX_OK) {
+      sbox_mutex_lock(&job->lock);
+      job->result = result;
+      job->next   = job->n;
+      sbox_mutex_unlock(&job->lock);
+      return 0;
+   }
+
+   while ((count = verify_take(job, &first)) != 0) {
+      for (k=first; k < first+count; ++k) {
+         uint32 item = job->order[k];
+         if (job->status[item] != SBOXKIT_VERIFY_OK) continue;
+         if (SboxVerifyItem(&checked, sbox, item) != SBOX_OK)
+            job->status[item] = SBOXKIT_VERIFY_CORRUPT;
+         else if (!checked)
+            job->status[item] = SBOXKIT_VERIFY_NO_CHECKSUM;
+      }
+   }
+   SboxReadClose(sbox);
+   return 0;
+}
+
+// find items outside the data area, or partly overlapping others;
+// items may share data, but only all of it
+static SboxResultCode verify_layout(SboxkitVerifyJob *job, SboxHandle *sbox)
+{
+   SboxResultCode result = SBOX_OK;
+   uint32 i, *loc, end = 0, end_loc = 0;
+
+   loc = malloc(job->n * sizeof(loc[0]) + 1);
+   if (loc == NULL)       return SBOX_OUT_OF_MEMORY;
+   for (i=0; i < job->n && result == SBOX_OK; ++i) {
+      result = SboxItemLoc(&loc[i], sbox, i);
+      if (result == SBOX_OK)
+         result = SboxItemStoredSize(&job->size[i], sbox, i);
+      if (result == SBOX_OK && SboxCheckItemRange(sbox, i) != SBOX_OK)
+         job->status[i] = SBOXKIT_VERIFY_OUT_OF_RANGE;
+   }
+   if (result == SBOX_OK)
+      result = SboxkitOrderByLocation(job->order, sbox);
+
+   for (i=0; i < job->n && result == SBOX_OK; ++i) {
+      uint32 item = job->order[i];
+      if (job->status[item] != SBOXKIT_VERIFY_OK || job->size[item] == 0)
+         continue;
+      if (loc[item] < end && (loc[item] != end_loc
+                          || loc[item] + job->size[item] != end))
+         job->status[item] = SBOXKIT_VERIFY_OVERLAP;
+      if (loc[item] + job->size[item] > end) {
+         end     = loc[item] + job->size[item];
+         end_loc = loc[item];
+      }
+   }
+   free(loc);
+   return result;
+}
+
+// check the sBOX file 'filename' (whose header, directory and tail are
+// checked by opening it) and every item in it, on up to 'threads'
+// threads; 'status' gets an SBOXKIT_VERIFY_* value for each item
+SboxResultCode SboxkitVerify(unsigned char *status, char *filename,
+                             char *sig, int threads)
+{
+   SboxThread thread[SBOXKIT_VERIFY_THREADS];
+   SboxkitVerifyJob job;
+   SboxResultCode result;
+   SboxHandle *sbox;
+   int i, started = 0;
+
+   result = SboxReadOpenFilename(&sbox, filename, sig);
+   if (result != SBOX_OK) return result;
+   result = SboxNumItems(&job.n, sbox);
+   if (result != SBOX_OK) { SboxReadClose(sbox); return result; }
+
+   job.filename = filename;
+   job.sig      = sig;
+   job.status   = status;
+   job.next     = 0;
+   job.result   = SBOX_OK;
+   job.order    = malloc(job.n * sizeof(job.order[0]) + 1);
+   job.size     = malloc(job.n * sizeof(job.size[0]) + 1);
+   memset(status, SBOXKIT_VERIFY_OK, job.n);
+   if (job.order == NULL || job.size == NULL)
+      result = SBOX_OUT_OF_MEMORY;
+   else
+      result = verify_layout(&job, sbox);
+   SboxReadClose(sbox);
+
+   if (result == SBOX_OK) {
+      // the calling thread is one of the workers
+      if (threads > SBOXKIT_VERIFY_THREADS) threads = SBOXKIT_VERIFY_THREADS;
+      sbox_mutex_init(&job.lock);
+      while (started < threads-1
+               && !sbox_thread_create(&thread[started], verify_thread, &job))
+         ++started;
+      verify_thread(&job);
+      for (i=0; i < started; ++i)
+         sbox_thread_join(thread[i]);
+      sbox_mutex_destroy(&job.lock);
+      result = job.result;
+   }
+   free(job.order);
+   free(job.size);
+   return result;
+}
+
 ////////////////////////////////////////////////////////////////////////////
 //
 //  interfaces without result codes (mainly useful for tools)
@@ -266,6 +709,27 @@ SboxHandle *SboxkitReadOpenFromFileBlock(FILE *f, uint32 offset,
    return sbox;
 }
 
+SboxHandle *SboxkitReadOpenFromMemory(void *data, uint32 size, char *sig)
+{
+   SboxHandle *sbox = NULL;
+   if (SboxReadOpenFromMemory(&sbox, data, size, sig) != SBOX_OK) ERROR();
+   return sbox;
+}
+
+SboxHandle *SboxkitReadOpenNested(SboxHandle *parent, uint32 item, char *sig)
+{
+   SboxHandle *sbox = NULL;
+   if (SboxReadOpenNested(&sbox, parent, item, sig) != SBOX_OK) ERROR();
+   return sbox;
+}
+
+SboxHandle *SboxkitReadClone(SboxHandle *sbox)
+{
+   SboxHandle *copy = NULL;
+   if (SboxReadClone(&copy, sbox) != SBOX_OK) ERROR();
+   return copy;
+}
+
 uint32 SboxkitNumItems(SboxHandle *sbox)
 {
    uint32 count=0;
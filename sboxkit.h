@@ -22,6 +22,9 @@ extern SboxHandle *SboxkitReadOpenFilename(char *filename, char *sig);
 extern SboxHandle *SboxkitReadOpenFromFile(FILE *f, int close, char *sig);
 extern SboxHandle *SboxkitReadOpenFromFileBlock(FILE *f, uint32 offset,
                                                    uint32 size, int close, char *sig);
+extern SboxHandle *SboxkitReadOpenFromMemory(void *data, uint32 size, char *sig);
+extern SboxHandle *SboxkitReadOpenNested(SboxHandle *parent, uint32 item, char *sig);
+extern SboxHandle *SboxkitReadClone(SboxHandle *sbox);
 extern SboxWriteHandle *SboxkitWriteOpenFromFilename(char *filename, char *sig);
 extern SboxWriteHandle *SboxkitWriteOpenFromFile(FILE *f, int close, char *sig);
 
@@ -90,6 +93,54 @@ extern uint32 SboxkitFindString(SboxHandle *sbox, char *str);
 extern SboxResultCode SboxkitStringPut(SboxWriteHandle *h, char *name,
       void *data, uint32 datasize);
 
+////////////////////////
+//
+// Copying and compaction
+
+// copy the value of item 'item' of 'in' into the item currently being
+// written to 'out' (between SboxWriteStartItem and SboxWriteEndItem);
+// uses in-kernel copies where available, else a bounded buffer
+extern SboxResultCode SboxkitCopyItemData(SboxWriteHandle *out,
+      SboxHandle *in, uint32 item);
+
+// copy whole items of 'in' to 'out' as they're stored: compressed
+// items stay compressed, checksums are carried over, and data shared
+// by several items is written once and shared again; SboxkitCopyItem()
+// gives the copy the name 'name', or the item's own if it's NULL
+typedef struct st_SboxkitCopy SboxkitCopy;
+
+extern SboxResultCode SboxkitCopyBegin(SboxkitCopy **copy,
+      SboxWriteHandle *out, SboxHandle *in);
+extern SboxResultCode SboxkitCopyItem(SboxkitCopy *copy, uint32 item,
+      char *name, int namesize);
+extern SboxResultCode SboxkitCopyEnd(SboxkitCopy *copy);
+
+// write every item of 'in' to 'out' as SboxkitCopyItem() does, in the
+// order given by the array 'order' of item ids, or in directory order
+// if 'order' is NULL; data not referenced by any item (see
+// SboxDeadSpace) is dropped
+extern SboxResultCode SboxkitCompact(SboxWriteHandle *out, SboxHandle *in,
+      uint32 *order);
+
+// fill 'order' with all item ids of 'sbox' sorted by data location
+extern SboxResultCode SboxkitOrderByLocation(uint32 *order, SboxHandle *sbox);
+
+////////////////////////
+//
+// Integrity checking
+
+#define SBOXKIT_VERIFY_OK            0   // data matches its checksum
+#define SBOXKIT_VERIFY_NO_CHECKSUM   1   // in range, but has no checksum
+#define SBOXKIT_VERIFY_OUT_OF_RANGE  2   // not in the data area
+#define SBOXKIT_VERIFY_OVERLAP       3   // partly overlaps another item
+#define SBOXKIT_VERIFY_CORRUPT       4   // checksum mismatch or read error
+
+// open 'filename', checking its header, tail and directory, then check
+// every item's placement and checksum on up to 'threads' threads;
+// 'status' (one byte per item) gets an SBOXKIT_VERIFY_* for each
+extern SboxResultCode SboxkitVerify(unsigned char *status, char *filename,
+      char *sig, int threads);
+
 //////////////////////////////////////////////////////////////////////////
 //
 //  simple support for repeated data items
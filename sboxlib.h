@@ -30,6 +30,68 @@ typedef enum
    SBOX_INVALID_ITEM,
 } SboxResultCode;
 
+// how an item's data is stored, so it can be copied to another sbox as
+// is (see SboxWriteStartStoredItem())
+typedef struct
+{
+   uint32 encoding;           // 0 if stored as is, else how it's compressed
+   uint32 size;               // as SboxItemSize()
+   int    has_crc;            // 'crc' is the CRC32C of the data as stored
+   uint32 crc;
+} SboxItemForm;
+
+/////////////////////////////////////////////////////////////////////////
+//
+//  I/O backends
+//
+//    sboxread and sboxwrit do all their I/O through an SboxIO.  A
+//    backend is a struct starting with an SboxIO, followed by whatever
+//    state it needs; clients can supply their own.
+
+typedef struct st_SboxIO SboxIO;
+
+struct st_SboxIO
+{
+   // read or write up to 'size' bytes at byte 'offset', returning how
+   // many were transferred; 'write' is NULL for read-only backends, and
+   // must allow calls from several threads at once for concurrent mode
+   uint32 (*read    )(SboxIO *io, uint32 offset, void *data, uint32 size);
+   uint32 (*write   )(SboxIO *io, uint32 offset, void *data, uint32 size);
+   uint32 (*size    )(SboxIO *io);
+   int    (*truncate)(SboxIO *io, uint32 size);   // 0 on success; may be NULL
+   void   (*close   )(SboxIO *io);                // releases the backend
+
+   // move up to 'size' bytes at 'offset' to the file descriptor 'fd'
+   // without passing them through user space, returning how many were
+   // moved; may be NULL
+   uint32 (*send    )(SboxIO *io, uint32 offset, uint32 size, int fd);
+
+   // a new backend onto the same data, with its own file position, to
+   // be used alongside this one in another thread; may be NULL
+   SboxIO *(*reopen )(SboxIO *io);
+
+   FILE   *f;                 // stdio backend only: written sequentially
+   unsigned char *map;        // all the data, if it's in memory already
+};
+
+// a FILE *, fclose()d on close if 'close' is true
+extern SboxIO *SboxIOStdio(FILE *f, int close);
+
+// a file descriptor, read and written with pread() and pwrite(), so
+// readers in many threads don't contend for a file position (not on
+// Windows, where it returns NULL)
+extern SboxIO *SboxIOFd(int fd, int close);
+
+// the whole of a file mapped read-only into memory (not on Windows)
+extern SboxIO *SboxIOMapFile(char *filename);
+
+// 'size' bytes of memory, read-only; if 'data' is NULL, an empty buffer
+// instead, which grows as it's written and is freed on close
+extern SboxIO *SboxIOMemory(void *data, uint32 size);
+
+// where a memory backend's data currently is, and how big it is
+extern void   *SboxIOMemoryData(SboxIO *io, uint32 *size);
+
 
 
 extern int   sbox_read_error_code;
@@ -40,6 +102,11 @@ extern unsigned long  sbox_max_memory_directory;
 #define SBOX_DIRECTORY_ALWAYS_IN_MEMORY    0xffffffff
 #define SBOX_DIRECTORY_NEVER_IN_MEMORY     0
 
+// a limit on the memory taken by the directories of all open sboxes
+// together; the biggest are read from their files while over it
+extern SboxResultCode SboxReadSetMemoryBudget(unsigned long budget);
+extern SboxResultCode SboxReadMemoryUsed(unsigned long *value);
+
 //////////////////////////////////////////////////////////////////////////
 
 #define SRC  SboxResultCode
@@ -52,6 +119,39 @@ extern SRC SboxReadOpenFilename(SboxHandle **handle, char *filename, char *sig);
 extern SRC SboxReadOpenFromFile(SboxHandle **handle, FILE *f, int close, char *sig);
 extern SRC SboxReadOpenFromFileBlock(SboxHandle **handle,
           FILE *f, uint32 offset, uint32 size, int close, char *sig);
+// the 'size' bytes at 'data' must stay valid until SboxReadClose()
+extern SRC SboxReadOpenFromMemory(SboxHandle **handle, void *data,
+          uint32 size, char *sig);
+// read through an I/O backend (see sboxio.h), closed with the sbox
+// if 'close' is true
+extern SRC SboxReadOpenIO(SboxHandle **handle, SboxIO *io, int close, char *sig);
+// as SboxReadOpenIO(), using an index file written by SboxReadSaveIndex()
+// if it's there and matches the sbox
+extern SRC SboxReadOpenWithIndex(SboxHandle **handle, SboxIO *io, int close,
+          char *index, char *sig);
+
+// choices made when opening an sbox; zero the whole struct, then set
+// the fields wanted, so that fields added later keep their defaults
+typedef struct
+{
+   int           lazy;         // find directory entries only as they're used
+   char         *index;        // index file to use, if it's there and matches
+   int           trusted;      // skip checking the directory; only for sboxes
+                               // from a source known to write them correctly
+   unsigned long max_memory;   // sbox_max_memory_directory for this sbox;
+                               // 0 for the global value
+} SboxReadOptions;
+
+extern SRC SboxReadOpenWithOptions(SboxHandle **handle, SboxIO *io, int close,
+          SboxReadOptions *options, char *sig);
+
+// the sbox stored as an item of 'parent'; close it before the parent
+extern SRC SboxReadOpenNested(SboxHandle **handle, SboxHandle *parent,
+          uint32 item, char *sig);
+
+// another handle on 'sbox' with a backend of its own, e.g. for another
+// thread, sharing its directory; close it before the original
+extern SRC SboxReadClone(SboxHandle **handle, SboxHandle *sbox);
 
 extern SRC SboxReadClose(SboxHandle *sbox);
 
@@ -70,19 +170,89 @@ extern SRC SboxNumItems(uint32 *value, SboxHandle *sbox);
 
 extern SRC SboxItemLoc (uint32 *value, SboxHandle *sbox, uint32 item);
 extern SRC SboxItemSize(uint32 *value, SboxHandle *sbox, uint32 item);
+extern SRC SboxItemStoredSize(uint32 *value, SboxHandle *sbox, uint32 item);
+// *value is 1 if the item is stored compressed, whatever its sizes
+extern SRC SboxItemPacked(uint32 *value, SboxHandle *sbox, uint32 item);
+// how the data is stored, for copying it as is
+extern SRC SboxItemStoredForm(SboxItemForm *form, SboxHandle *sbox, uint32 item);
 extern SRC SboxNameSize(uint32 *value, SboxHandle *sbox, uint32 item);
 
 extern SRC SboxNameData  (void **value,                 SboxHandle *sbox, uint32 item);
 extern SRC SboxNameBuffer(void *buffer, uint32 bufsize, SboxHandle *sbox, uint32 item);
 
+// every item's location, stored size and name at once; *entries has
+// one per item, *names holds the names back to back, and both are in
+// the one block free(*entries) releases
+typedef struct
+{
+   uint32 offset;             // as SboxItemLoc()
+   uint32 size;               // as SboxItemStoredSize()
+   uint32 name;               // where the name starts in *names
+   uint32 namesize;
+} SboxListEntry;
+
+extern SRC SboxListNames(char **names, SboxListEntry **entries, SboxHandle *sbox);
+
+// every item in order, reading the directory from the file in large
+// blocks, without it being held or indexed in memory (open the sbox
+// with 'lazy' for it not to be at open either)
+typedef struct st_SboxDirIter SboxDirIter;
+
+typedef struct
+{
+   uint32 item;               // SBOX_NOT_FOUND once past the last item
+   uint32 offset;             // as SboxItemLoc()
+   uint32 size;               // as SboxItemStoredSize()
+   uint32 namesize;
+   void  *name;               // good until the next call
+} SboxDirEntry;
+
+extern SRC SboxDirIterBegin(SboxDirIter **iter, SboxHandle *sbox);
+extern SRC SboxDirIterNext (SboxDirEntry *entry, SboxDirIter *iter);
+extern SRC SboxDirIterEnd  (SboxDirIter *iter);
+
+// *item is the first item with the name, or SBOX_NOT_FOUND
+#define SBOX_NOT_FOUND   ((uint32) -1)
+extern SRC SboxFindName  (uint32 *item, SboxHandle *sbox, void *name, uint32 namelen);
+// build a hash table of the names, so SboxFindName() doesn't scan the
+// directory; threads may then look names up at the same time
+extern SRC SboxReadSetNameIndex(SboxHandle *sbox, int enable);
+// write the parsed directory and name index to an index file, which
+// other processes can map and use instead of parsing the directory
+extern SRC SboxReadSaveIndex(SboxHandle *sbox, char *filename);
+
+// the item's data in place, if the sbox is in memory (opened from
+// memory, or through a mapped backend) and the item isn't compressed
+extern SRC SboxItemData  (void **value,                 SboxHandle *sbox, uint32 item);
+
+// number of bytes in the file not used by any item or by sBOX structures
+extern SRC SboxDeadSpace (uint32 *value,                SboxHandle *sbox);
+
 /////
 //
 // access values
 
 extern uint32 SboxReadItem(void *buffer, uint32 bufsize,
                              SboxHandle *sbox, uint32 item, uint32 offset);
+// as SboxReadItem(), but the bytes as stored: not decompressed or checked
+extern uint32 SboxReadStored(void *buffer, uint32 bufsize,
+                             SboxHandle *sbox, uint32 item, uint32 offset);
 extern SRC    SboxSeekItem(  SboxHandle *sbox, uint32 item, uint32 offset);
 extern FILE  *SboxFileHandle(SboxHandle *sbox);
+// copy up to 'length' bytes of an item to a file descriptor or socket,
+// inside the kernel where possible; returns the number of bytes copied
+extern uint32 SboxCopyItemToFd(SboxHandle *sbox, uint32 item,
+                               uint32 offset, uint32 length, int fd);
+
+// check an item's data against the checksum it was written with;
+// *checked is 0 if it has none, and a mismatch is SBOX_INVALID_ITEM
+extern SRC    SboxVerifyItem(uint32 *checked, SboxHandle *sbox, uint32 item);
+// have SboxReadItem() check each item the first time it's read, and
+// fail (returning 0) if the checksum doesn't match
+extern SRC    SboxReadSetVerify(SboxHandle *sbox, int enable);
+// SBOX_OK if the item's data lies between the header and the tail,
+// clear of the directory
+extern SRC    SboxCheckItemRange(SboxHandle *sbox, uint32 item);
 
 #undef SRC
 
@@ -102,9 +272,69 @@ extern SRC SboxWriteStartItem(SboxWriteHandle *h);
 extern SRC SboxWriteEndItemNamed(SboxWriteHandle *h, char *name, int namesize);
 extern SRC SboxWriteEndItem(SboxWriteHandle *h);
 extern SRC SboxWriteData(SboxWriteHandle *h, void *data, uint32 datasize);
+
+// copying items as they're stored elsewhere: start an item whose data,
+// given next with SboxWriteData(), is already in the form 'form' says
+// (see SboxItemStoredForm()), so it's written neither compressed nor
+// checksummed again; or add an item sharing the 'size' bytes at
+// 'offset' (from SboxWriteItemLoc()) which an earlier item wrote
+extern SRC SboxWriteStartStoredItem(SboxWriteHandle *h, char *name, int namesize,
+                                                SboxItemForm *form);
+extern SRC SboxWriteSharedItem(SboxWriteHandle *h, char *name, int namesize,
+                               uint32 offset, uint32 size, SboxItemForm *form);
+// where the data of the newest item starts, as SboxItemLoc() will report
+// it once the sbox is read; final after SboxWriteEndItem()
+extern SRC SboxWriteItemLoc(uint32 *value, SboxWriteHandle *h);
+
+// make item data start at a multiple of 'align' bytes from the start of
+// the file, either for every item or just for the next one started;
+// the padding is not counted as part of any item
+extern SRC SboxWriteSetAlignment(SboxWriteHandle *h, uint32 align);
+extern SRC SboxWriteAlignNextItem(SboxWriteHandle *h, uint32 align);
+
+// deduplication: items whose data is identical to an earlier item's
+// share the earlier data instead of storing another copy
+extern SRC SboxWriteSetDedup(SboxWriteHandle *h, int enable);
+
+// record the CRC32C of each item's data, for SboxVerifyItem()
+extern SRC SboxWriteSetChecksums(SboxWriteHandle *h, int enable);
+extern int SboxWriteChecksums(SboxWriteHandle *h);
+
+// keep at most about 'budget' bytes of directory in memory, spilling
+// older entries to a temporary file; 0 (the default) means no limit
+extern SRC SboxWriteSetDirectoryBudget(SboxWriteHandle *h, uint32 budget);
+
+// compress the data of items written with SboxWriteData() from now on;
+// readers decompress them transparently
+extern SRC SboxWriteSetCompression(SboxWriteHandle *h, int enable);
+extern int SboxWriteCompression(SboxWriteHandle *h);
+
+// compressed items are split in chunks of this many bytes (64K if 0),
+// so parts of them can be read without decompressing all of it
+extern SRC SboxWriteSetChunkSize(SboxWriteHandle *h, uint32 size);
+
+// compress chunks on this many background threads (0, the default,
+// compresses on the calling thread); output is the same either way
+extern SRC SboxWriteSetCompressionThreads(SboxWriteHandle *h, int threads);
+
+// write-behind: SboxWriteData() copies into 'numbufs' buffers of 'bufsize'
+// bytes which a background thread writes out; SboxWriteEndItem() reports
+// its errors and SboxWriteClose() waits for it to finish
+extern SRC SboxWriteSetWriteBehind(SboxWriteHandle *h, uint32 bufsize, int numbufs);
+
+// concurrent mode: after SboxWriteSetConcurrent(), any number of threads
+// may add complete items with SboxWriteConcurrentItem(); no other calls
+// but SboxWriteClose() are allowed, and the FILE * must not be touched
+extern SRC SboxWriteSetConcurrent(SboxWriteHandle *h);
+extern SRC SboxWriteConcurrentItem(SboxWriteHandle *h, char *name, int namesize,
+                                                void *data, uint32 datasize);
 extern SRC SboxWriteClose(SboxWriteHandle *handle);
 extern SRC SboxWriteOpenFromFile(SboxWriteHandle **handle, FILE *f, int close, char *signature);
 extern SRC SboxWriteOpenFilename(SboxWriteHandle **handle, char *filename, char *signature);
+// write from the start of an I/O backend (see sboxio.h), closed with
+// the sbox if 'close' is true; SboxWriteFileHandle() then returns NULL
+// unless it's a stdio backend
+extern SRC SboxWriteOpenIO(SboxWriteHandle **handle, SboxIO *io, int close, char *signature);
 
 extern FILE *SboxWriteFileHandle(SboxWriteHandle *sbox);
 
@@ -127,6 +357,9 @@ extern SboxHandle *SboxkitReadOpenFilename(char *filename, char *sig);
 extern SboxHandle *SboxkitReadOpenFromFile(FILE *f, int close, char *sig);
 extern SboxHandle *SboxkitReadOpenFromFileBlock(FILE *f, uint32 offset,
                                                    uint32 size, int close, char *sig);
+extern SboxHandle *SboxkitReadOpenFromMemory(void *data, uint32 size, char *sig);
+extern SboxHandle *SboxkitReadOpenNested(SboxHandle *parent, uint32 item, char *sig);
+extern SboxHandle *SboxkitReadClone(SboxHandle *sbox);
 extern SboxWriteHandle *SboxkitWriteOpenFromFilename(char *filename, char *sig);
 extern SboxWriteHandle *SboxkitWriteOpenFromFile(FILE *f, int close, char *sig);
 
@@ -193,6 +426,54 @@ extern uint32 SboxkitFindString(SboxHandle *sbox, char *str);
 extern SboxResultCode SboxkitStringPut(SboxWriteHandle *h, char *name,
       void *data, uint32 datasize);
 
+////////////////////////
+//
+// Copying and compaction
+
+// copy the value of item 'item' of 'in' into the item currently being
+// written to 'out' (between SboxWriteStartItem and SboxWriteEndItem);
+// uses in-kernel copies where available, else a bounded buffer
+extern SboxResultCode SboxkitCopyItemData(SboxWriteHandle *out,
+      SboxHandle *in, uint32 item);
+
+// copy whole items of 'in' to 'out' as they're stored: compressed
+// items stay compressed, checksums are carried over, and data shared
+// by several items is written once and shared again; SboxkitCopyItem()
+// gives the copy the name 'name', or the item's own if it's NULL
+typedef struct st_SboxkitCopy SboxkitCopy;
+
+extern SboxResultCode SboxkitCopyBegin(SboxkitCopy **copy,
+      SboxWriteHandle *out, SboxHandle *in);
+extern SboxResultCode SboxkitCopyItem(SboxkitCopy *copy, uint32 item,
+      char *name, int namesize);
+extern SboxResultCode SboxkitCopyEnd(SboxkitCopy *copy);
+
+// write every item of 'in' to 'out' as SboxkitCopyItem() does, in the
+// order given by the array 'order' of item ids, or in directory order
+// if 'order' is NULL; data not referenced by any item (see
+// SboxDeadSpace) is dropped
+extern SboxResultCode SboxkitCompact(SboxWriteHandle *out, SboxHandle *in,
+      uint32 *order);
+
+// fill 'order' with all item ids of 'sbox' sorted by data location
+extern SboxResultCode SboxkitOrderByLocation(uint32 *order, SboxHandle *sbox);
+
+////////////////////////
+//
+// Integrity checking
+
+#define SBOXKIT_VERIFY_OK            0   // data matches its checksum
+#define SBOXKIT_VERIFY_NO_CHECKSUM   1   // in range, but has no checksum
+#define SBOXKIT_VERIFY_OUT_OF_RANGE  2   // not in the data area
+#define SBOXKIT_VERIFY_OVERLAP       3   // partly overlaps another item
+#define SBOXKIT_VERIFY_CORRUPT       4   // checksum mismatch or read error
+
+// open 'filename', checking its header, tail and directory, then check
+// every item's placement and checksum on up to 'threads' threads;
+// 'status' (one byte per item) gets an SBOXKIT_VERIFY_* for each
+extern SboxResultCode SboxkitVerify(unsigned char *status, char *filename,
+      char *sig, int threads);
+
 //////////////////////////////////////////////////////////////////////////
 //
 //  simple support for repeated data items
@@ -0,0 +1,173 @@
+// sboxlz.c
+//    LZ4 block format compressor and decompressor for item data
+//
+// Each sequence is a token byte (literal count in the high nibble,
+// match length minus 4 in the low nibble, 15 meaning 'more bytes
+// follow'), the literals, and a 2-byte little-endian match offset.
+// The last sequence is literals only.  The compressor is the usual
+// greedy single-probe hash search; it favors speed over ratio, since
+// it is there to cut I/O, not to archive.
+
+#include <string.h>
+
+#include "sboxlz.h"
+
+#define LZ_MINMATCH       4
+#define LZ_LASTLITERALS   5            // last bytes are always literals
+#define LZ_MFLIMIT        12           // no match starts this near the end
+#define LZ_MAX_DISTANCE   65535
+#define LZ_HASH_BITS      14
+#define LZ_SKIP_SHIFT     6            // search faster in incompressible data
+
+static uint32 lz_read32(unsigned char *p)
+{
+   uint32 v;
+   memcpy(&v, p, 4);
+   return v;
+}
+
+static uint32 lz_hash(uint32 v)
+{
+   return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *lz_put_length(unsigned char *op, uint32 n)
+{
+   while (n >= 255) {
+      *op++ = 255;
+      n -= 255;
+   }
+   *op++ = (unsigned char) n;
+   return op;
+}
+
+// emit 'lit' literals and then a match of 'len' bytes 'offset' back
+// (no match if 'offset' is 0); NULL if it doesn't fit
+static unsigned char *lz_sequence(unsigned char *op, unsigned char *oend,
+           unsigned char *literals, uint32 lit, uint32 offset, uint32 len)
+{
+   unsigned char *token;
+
+   if ((uint32) (oend - op) < lit + lit/255 + len/255 + 5) return NULL;
+
+   token = op++;
+   *token = (unsigned char) ((lit < 15 ? lit : 15) << 4);
+   if (lit >= 15) op = lz_put_length(op, lit - 15);
+   memcpy(op, literals, lit);
+   op += lit;
+
+   if (offset != 0) {
+      *op++ = (unsigned char) (offset & 255);
+      *op++ = (unsigned char) (offset >> 8);
+      len -= LZ_MINMATCH;
+      *token |= (unsigned char) (len < 15 ? len : 15);
+      if (len >= 15) op = lz_put_length(op, len - 15);
+   }
+   return op;
+}
+
+uint32 sbox_lz_bound(uint32 size)
+{
+   return size + size/255 + 16;
+}
+
+uint32 sbox_lz_compress(unsigned char *dest, uint32 destsize,
+                        unsigned char *src, uint32 size)
+{
+   uint32 table[1 << LZ_HASH_BITS];
+   unsigned char *ip = src, *anchor = src, *end = src + size;
+   unsigned char *op = dest, *oend = dest + destsize;
+
+   if (size > LZ_MFLIMIT) {
+      unsigned char *mflimit    = end - LZ_MFLIMIT;
+      unsigned char *matchlimit = end - LZ_LASTLITERALS;
+
+      memset(table, 0, sizeof(table));
+      while (ip < mflimit) {
+         uint32 h = lz_hash(lz_read32(ip)), len;
+         unsigned char *ref = src + table[h];
+
+         table[h] = (uint32) (ip - src);
+         if (ref >= ip || ip - ref > LZ_MAX_DISTANCE
+                       || lz_read32(ref) != lz_read32(ip)) {
+            ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+         }
+
+         // extend the match both ways
+         while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            --ip;
+            --ref;
+         }
+         len = LZ_MINMATCH;
+         while (ip + len < matchlimit && ip[len] == ref[len])
+            ++len;
+
+         op = lz_sequence(op, oend, anchor, (uint32) (ip - anchor),
+                                            (uint32) (ip - ref), len);
+         if (op == NULL) return 0;
+         ip += len;
+         anchor = ip;
+      }
+   }
+
+   op = lz_sequence(op, oend, anchor, (uint32) (end - anchor), 0, 0);
+   if (op == NULL) return 0;
+   return (uint32) (op - dest);
+}
+
+static int lz_get_length(unsigned char **ip, unsigned char *iend, uint32 *len)
+{
+   uint32 b;
+   do {
+      if (*ip >= iend || *len > 0xffffffff - 255) return 1;
+      b = *(*ip)++;
+      *len += b;
+   } while (b == 255);
+   return 0;
+}
+
+int sbox_lz_decompress(unsigned char *dest, uint32 destsize,
+                       unsigned char *src, uint32 size)
+{
+   unsigned char *ip = src, *iend = src + size;
+   unsigned char *op = dest, *oend = dest + destsize;
+
+   for (;;) {
+      uint32 token, len, offset;
+      unsigned char *ref;
+
+      if (ip >= iend) return 1;
+      token = *ip++;
+
+      // literals
+      len = token >> 4;
+      if (len == 15 && lz_get_length(&ip, iend, &len)) return 1;
+      if ((uint32) (iend - ip) < len || (uint32) (oend - op) < len) return 1;
+      memcpy(op, ip, len);
+      op += len;
+      ip += len;
+      if (ip == iend) break;
+
+      // match
+      if (iend - ip < 2) return 1;
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (offset == 0 || offset > (uint32) (op - dest)) return 1;
+      len = token & 15;
+      if (len == 15 && lz_get_length(&ip, iend, &len)) return 1;
+      len += LZ_MINMATCH;
+      if ((uint32) (oend - op) < len) return 1;
+
+      ref = op - offset;
+      if (offset >= len) {
+         memcpy(op, ref, len);
+         op += len;
+      } else {
+         // overlapping, e.g. a run
+         while (len--)
+            *op++ = *ref++;
+      }
+   }
+   return op != oend;
+}
@@ -0,0 +1,22 @@
+#ifndef INCLUDE_SBOXLZ_H
+#define INCLUDE_SBOXLZ_H
+
+#include "sbox.h"
+
+// a small LZ77 codec producing the LZ4 block format, used by sboxread
+// and sboxwrit for compressed items; not part of the public API
+
+// largest possible compressed size of 'size' bytes
+extern uint32 sbox_lz_bound(uint32 size);
+
+// compress 'size' bytes of 'src' into 'dest'; returns the compressed
+// size, or 0 if it doesn't fit in 'destsize' bytes
+extern uint32 sbox_lz_compress(unsigned char *dest, uint32 destsize,
+                               unsigned char *src, uint32 size);
+
+// decompress 'size' bytes of 'src', which must expand to exactly
+// 'destsize' bytes; returns 0 on success, nonzero if 'src' is corrupt
+extern int sbox_lz_decompress(unsigned char *dest, uint32 destsize,
+                              unsigned char *src, uint32 size);
+
+#endif
@@ -5,9 +5,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define write   _write
+#else
+#include <unistd.h>
+#endif
 
 #include "sboxread.h"
 #include "sboxtype.h"
+#include "sboxlz.h"
+#include "sboxcrc.h"
 
 /////
 //
@@ -24,7 +34,15 @@ static char *magic = "sb0X";
 #define test_magic(str)  (!memcmp(magic, (str), INTSIZE))
 
 // convert a uchar* pointing to a little-endian integer into a native integer
-#define little_int(x)    ((((x)[3]*256+(x)[2])*256+(x)[1])*256+(x)[0])
+#define little_int(x)    (((((uint32) (x)[3])*256+(x)[2])*256+(x)[1])*256+(x)[0])
+#define min(x,y)         ((x) < (y) ? (x) : (y))
+
+// whether the host's integers are laid out as the file's are
+static int little_endian_host(void)
+{
+   uint32 one = 1;
+   return *(unsigned char *) &one == 1;
+}
 
 /////
 //
@@ -45,7 +63,8 @@ enum ErrorCodes
    MAGIC3= 3, NAMESIZE= 13, OUT_OF_RANGE  = 23,
    SHORT = 4, DIR_MEM = 14, DIRSIZE_MATCH = 24,
    FREAD = 5, NO_FILE = 15, BAD_SIGNATURE = 25,
-   FSEEK = 6, FWRITE  = 16,
+   FSEEK = 6, FWRITE  = 16, META          = 26,
+   CORRUPT=7,                 NOT_MAPPED    = 27,
 };
 
 static struct { int code; char *str; } read_error_strings[] =
@@ -63,8 +82,11 @@ static struct { int code; char *str; } read_error_strings[] =
    { MAGIC2        , "Magic number not present in tail"   },
    { MAGIC3        , "Magic number not present in directory" },
    { BAD_SIGNATURE , "File signature not found" },
+   { CORRUPT       , "Item data is corrupt" },
+   { META          , "Invalid item attributes" },
    { NAMESIZE      , "Name in directory has invalid size" },
    { NO_FILE       , "Couldn't open file" },
+   { NOT_MAPPED    , "Item data is not in memory" },
    { OUT_OF_RANGE  , "Item outside of range" },
    { SHORT         , "File too short to contain header" },
 #else
@@ -123,10 +145,24 @@ static void sbox_cleanup(SboxHandle *sbox)
 // pretend the chunk the sbox is in is the whole file
 static int sbox_seek(SboxHandle *sbox, uint32 offset)
 {
-   fseek(sbox->f, sbox->start+offset, SEEK_SET);
+   if (sbox->io->f)
+      fseek(sbox->io->f, sbox->start+offset, SEEK_SET);
    return 0;
 }
 
+// read up to 'size' bytes at 'offset' in the sbox; returns the number
+// of bytes read
+static uint32 sbox_read(SboxHandle *sbox, uint32 offset, void *dest, uint32 size)
+{
+   if (offset >= sbox->length) return 0;
+   size = min(size, sbox->length - offset);
+   if (sbox->io->map != NULL) {
+      memcpy(dest, sbox->io->map + sbox->start + offset, size);
+      return size;
+   }
+   return sbox->io->read(sbox->io, sbox->start + offset, dest, size);
+}
+
 /////
 //
 // parse header
@@ -140,7 +176,6 @@ typedef struct
 
 static SboxResultCode locate_directory(SboxHandle *sbox, SboxDirectoryInfo *sd, char *sig)
 {
-   FILE *f = sbox->f;
    uint32 diroff, dirsize;
    unsigned char buffer[16 + INTSIZE*2];
 
@@ -148,8 +183,8 @@ static SboxResultCode locate_directory(SboxHandle *sbox, SboxDirectoryInfo *sd,
 
    if (sbox->length < 16+INTSIZE*2)         return ERROR(HEADER, SHORT);
 
-   if (sbox_seek(sbox, 0) != 0)             return ERROR(HEADER, FREAD);
-   if (fread(buffer,16+INTSIZE*2, 1, f)!=1) return ERROR(HEADER, FREAD);
+   if (sbox_read(sbox, 0, buffer, 16+INTSIZE*2) != 16+INTSIZE*2)
+                                            return ERROR(HEADER, FREAD);
    if (sig && memcmp(sig, buffer, 16))      return ERROR(HEADER, BAD_SIGNATURE);
    if (!test_magic(buffer+16))              return ERROR(HEADER, MAGIC1);
 
@@ -162,8 +197,8 @@ static SboxResultCode locate_directory(SboxHandle *sbox, SboxDirectoryInfo *sd,
 
    // find and parse tail
 
-   if (sbox_seek(sbox, sbox->length-INTSIZE*2) != 0) return ERROR(TAIL,FREAD);
-   if (fread(buffer, INTSIZE, 2, f) != 2)   return ERROR(TAIL, FREAD);
+   if (sbox_read(sbox, sbox->length-INTSIZE*2, buffer, INTSIZE*2) != INTSIZE*2)
+                                            return ERROR(TAIL, FREAD);
    if (!test_magic(buffer+INTSIZE))         return ERROR(TAIL, MAGIC2);
 
    if (diroff == 0) {
@@ -176,8 +211,8 @@ static SboxResultCode locate_directory(SboxHandle *sbox, SboxDirectoryInfo *sd,
 
    // find and parse directory header
 
-   if (sbox_seek(sbox, diroff) != 0)        return ERROR(DIRECTORY, FREAD);
-   if (fread(buffer, INTSIZE, 2, f) != 2)   return ERROR(DIRECTORY, FREAD);
+   if (sbox_read(sbox, diroff, buffer, INTSIZE*2) != INTSIZE*2)
+                                            return ERROR(DIRECTORY, FREAD);
    if (!test_magic(buffer))                 return ERROR(DIRECTORY, MAGIC3);
 
    dirsize = little_int(buffer+INTSIZE);
@@ -248,8 +283,8 @@ static SboxResultCode load_directory(SboxHandle *sbox, uint32 diroff, uint32 siz
    assert(sbox->free_me == NULL);
    sbox->free_me = dir;
 
-   sbox_seek(sbox, diroff);
-   if (fread(dir, size, 1, sbox->f) != 1)     return ERROR(DIRECTORY, FREAD);
+   if (sbox_read(sbox, diroff, dir, size) != size)
+                                              return ERROR(DIRECTORY, FREAD);
 
    result = endian_fix_and_count_directory(dir, size, &sbox->num_items);
    if (result != SBOX_OK)                     return result;
@@ -267,6 +302,39 @@ static SboxResultCode load_directory(SboxHandle *sbox, uint32 diroff, uint32 siz
    return SBOX_OK;
 }
 
+// on a little-endian host, a directory as stored is already an array
+// of SboxDirectoryItems, so one from a trusted source is used as it is:
+// neither rewritten nor checked, and not even copied if it's mapped
+static SboxResultCode trusted_directory(SboxHandle *sbox, uint32 diroff, uint32 size)
+{
+   uint32 i,offset;
+   unsigned char *dir;
+
+   dir = sbox->io->map ? sbox->io->map + sbox->start + diroff : NULL;
+   if (dir == NULL || ((size_t) dir & INTMOD)) {
+      dir = malloc(size);
+      if (!dir)                               return ERROR(OOM, DIR_MEM);
+      assert(sbox->free_me == NULL);
+      sbox->free_me = dir;
+      if (sbox_read(sbox, diroff, dir, size) != size)
+                                              return ERROR(DIRECTORY, FREAD);
+   }
+
+   sbox->num_items = 0;
+   for (offset=0; offset < size; ++sbox->num_items)
+      offset += offset_to_next_item(((SboxDirectoryItem *) &dir[offset])->namesize);
+
+   sbox->directory = malloc(sbox->num_items * sizeof(sbox->directory[0]));
+   if (sbox->directory == NULL)               return ERROR(OOM, DIRINDEX_MEM);
+
+   offset = 0;
+   for (i=0; i < sbox->num_items; ++i) {
+      sbox->directory[i] = (SboxDirectoryItem *) &dir[offset];
+      offset += offset_to_next_item(sbox->directory[i]->namesize);
+   }
+   return SBOX_OK;
+}
+
 ///////////////////////
 //
 // build an index of the directory in system memory
@@ -307,8 +375,7 @@ static SboxResultCode scan_directory(SboxHandle *sbox,
          sbox->directory_index = directory_index;
       }
       directory_index[items] = diroff+offset;
-      sbox_seek(sbox, diroff+offset);
-      if (fread(buffer, INTSIZE, 3, sbox->f) != 3)
+      if (sbox_read(sbox, diroff+offset, buffer, INTSIZE*3) != INTSIZE*3)
          return ERROR(DIRECTORY, FREAD);
       namesize = little_int(buffer+INTSIZE*2);
   
@@ -317,6 +384,7 @@ static SboxResultCode scan_directory(SboxHandle *sbox,
          return ERROR(DIRECTORY, NAMESIZE);
 
       offset += offset_to_next_item(namesize);
+      ++items;
    }
    if (offset != size)
       return ERROR(DIRECTORY, DIRSIZE_MATCH);
@@ -331,23 +399,379 @@ static SboxResultCode scan_directory(SboxHandle *sbox,
 
 unsigned long sbox_max_memory_directory = SBOX_DIRECTORY_ALWAYS_IN_MEMORY;
 
-static SboxResultCode read_directory(SboxHandle *sbox, char *sig)
+static SboxResultCode read_meta(SboxHandle *sbox);
+static SboxResultCode lazy_directory(SboxHandle *sbox, unsigned long max_memory);
+static int load_index(SboxHandle *sbox, char *filename);
+
+static SboxResultCode read_directory(SboxHandle *sbox, char *sig,
+                                     SboxReadOptions *options)
 {
    SboxDirectoryInfo sd;
    SboxResultCode result;
+   unsigned long max_memory = options->max_memory ? options->max_memory
+                                                  : sbox_max_memory_directory;
 
    result = locate_directory(sbox, &sd, sig);
    if (result != SBOX_OK) return result;
 
+   sbox->diroff  = sd.diroff;
+   sbox->dirsize = sd.dirsize;
+
    if (sd.dirsize == 0) {
       sbox->num_items = 0;
       return SBOX_OK;
    }
 
-   if (sd.dirsize > sbox_max_memory_directory)
-      return scan_directory(sbox, sd.diroff, sd.dirsize);
+   if (options->index && load_index(sbox, options->index))
+      return SBOX_OK;
+
+   if (options->lazy)
+      return lazy_directory(sbox, max_memory);
+
+   // a trusted directory that's mapped isn't copied, so its size
+   // doesn't matter
+   sbox->trusted = options->trusted && little_endian_host();
+   if (sbox->trusted && (sbox->io->map || sd.dirsize <= max_memory))
+      result = trusted_directory(sbox, sd.diroff, sd.dirsize);
+   else if (sd.dirsize > max_memory)
+      result = scan_directory(sbox, sd.diroff, sd.dirsize);
+   else
+      result = load_directory(sbox, sd.diroff, sd.dirsize);
+   if (result != SBOX_OK) return result;
+
+   return read_meta(sbox);
+}
+
+/////
+//
+// lazily opened directories
+//
+// A lazy sbox keeps its directory in memory as stored, and finds the
+// entries only as far as they are used, so opening it costs one read
+// (or none, if the sbox is mapped) however large the directory is.
+// One too big to keep isn't read at all until an entry is needed, and
+// then all of them are found at once, as for any directory that big.
+// The meta item is found at open by looking for it at the end of the
+// directory, and this is confirmed once all the entries are found.
+
+// find the entries up to 'entry'; SBOX_INVALID_ITEM if there aren't
+// that many, which also means all of them are found
+static SboxResultCode lazy_locate(SboxHandle *sbox, uint32 entry)
+{
+   SboxResultCode result;
+   uint32 offset, namesize, meta_entry;
+
+   // one that isn't held is found all at once
+   if (sbox->dir_image == NULL) {
+      result = scan_directory(sbox, sbox->diroff, sbox->dirsize);
+      if (result != SBOX_OK) return result;
+      sbox->located    = sbox->num_items;
+      sbox->next_entry = sbox->dirsize;
+      entry = 0xffffffff;
+   }
+
+   while (sbox->located <= entry) {
+      offset = sbox->next_entry;
+      if (offset == sbox->dirsize)
+         break;
+      if (offset > sbox->dirsize || sbox->dirsize - offset < INTSIZE*3)
+         return ERROR(DIRECTORY, DIRSIZE_MATCH);
+      namesize = little_int(sbox->dir_image + offset + INTSIZE*2);
+      if (namesize > sbox->dirsize - offset - INTSIZE*3)
+         return ERROR(DIRECTORY, NAMESIZE);
+      if (sbox->located == sbox->located_max) {
+         grow_directory(&sbox->directory_index, &sbox->located_max);
+         if (sbox->directory_index == NULL)
+            return ERROR(OOM, DIRINDEX_MEM);
+      }
+      sbox->directory_index[sbox->located++] = sbox->diroff + offset;
+      sbox->next_entry = offset + offset_to_next_item(namesize);
+   }
+   if (sbox->located > entry) return SBOX_OK;
+
+   // all found; if what looked like the meta item isn't the last
+   // entry, it was the end of some item's name
+   meta_entry = sbox->diroff + sbox->dirsize - offset_to_next_item(SBOX_META_NAMESIZE);
+   if (sbox->has_meta && sbox->directory_index[sbox->located-1] != meta_entry) {
+      free(sbox->meta);
+      sbox->meta      = NULL;
+      sbox->num_meta  = 0;
+      sbox->meta_size = 0;
+      sbox->has_meta  = 0;
+   }
+   sbox->num_items = sbox->located - sbox->has_meta;
+   sbox->lazy = 0;
+   return SBOX_INVALID_ITEM;
+}
+
+static SboxResultCode lazy_finish(SboxHandle *sbox)
+{
+   if (sbox->lazy) lazy_locate(sbox, 0xffffffff);
+   return sbox->lazy ? SBOX_INVALID_DIRECTORY : SBOX_OK;
+}
+
+// whether 'item' exists, finding it first if the sbox is lazy
+static int have_item(SboxHandle *sbox, uint32 item)
+{
+   if (sbox->lazy && item < 0xffffffff - 1)
+      lazy_locate(sbox, item + sbox->has_meta);
+   if (sbox->lazy)
+      return item + sbox->has_meta < sbox->located;
+   return item < sbox->num_items;
+}
+
+static SboxResultCode parse_meta(SboxHandle *sbox, unsigned char *data,
+                                 uint32 size, uint32 limit);
+
+static SboxResultCode lazy_directory(SboxHandle *sbox, unsigned long max_memory)
+{
+   SboxResultCode result;
+   unsigned char *entry, *data, tail[INTSIZE*3 + SBOX_META_NAMESIZE + 2];
+   uint32 size, last = offset_to_next_item(SBOX_META_NAMESIZE);
+
+   if (sbox->io->map) {
+      sbox->dir_image = sbox->io->map + sbox->start + sbox->diroff;
+   } else if (sbox->dirsize <= max_memory) {
+      sbox->free_me = malloc(sbox->dirsize);
+      if (sbox->free_me == NULL)             return ERROR(OOM, DIR_MEM);
+      if (sbox_read(sbox, sbox->diroff, sbox->free_me, sbox->dirsize) != sbox->dirsize)
+                                             return ERROR(DIRECTORY, FREAD);
+      sbox->dir_image = sbox->free_me;
+   }
+   if (sbox->dir_image) {
+      sbox->located_max = 16;
+      sbox->directory_index = malloc(sbox->located_max * sizeof(sbox->directory_index[0]));
+      if (sbox->directory_index == NULL)     return ERROR(OOM, DIRINDEX_MEM);
+   }
+   sbox->lazy = 1;
+
+   // the meta item, if there is one, is the last entry
+   if (sbox->dirsize < last)                 return SBOX_OK;
+   if (sbox->dir_image)
+      entry = sbox->dir_image + sbox->dirsize - last;
+   else {
+      entry = tail;
+      if (sbox_read(sbox, sbox->diroff + sbox->dirsize - last, tail, last) != last)
+                                             return ERROR(DIRECTORY, FREAD);
+   }
+   if (little_int(entry + INTSIZE*2) != SBOX_META_NAMESIZE
+         || memcmp(entry + INTSIZE*3, SBOX_META_NAME, SBOX_META_NAMESIZE))
+      return SBOX_OK;
+
+   // if it isn't readable meta data, this is the end of some name
+   size = little_int(entry + INTSIZE);
+   if (size < INTSIZE*3 || size > sbox->length) return SBOX_OK;
+   data = malloc(size);
+   if (data == NULL)                         return ERROR(OOM, DIR_MEM);
+   if (sbox_read(sbox, little_int(entry), data, size) != size
+         || memcmp(data, SBOX_META_MAGIC, 4)) {
+      free(data);
+      return SBOX_OK;
+   }
+   // records for items past the end are never looked up, so the
+   // number of items needn't be known to check them
+   result = parse_meta(sbox, data, size, 0xffffffff);
+   free(data);
+   if (result == SBOX_OK) sbox->has_meta = 1;
+   return result;
+}
+
+/////
+//
+// memory budget
+//
+// Every directory held in memory is counted against one budget shared
+// by all handles.  When they take more than it, the biggest are moved
+// out to the file, the way directories too big to load are read, and
+// when there's room again they're loaded back.  The budget is balanced
+// when a handle is opened or closed, or the budget is set, but that
+// only marks the handles to be moved; each moves itself on its next
+// call that looks at the directory, under its own lock, so nothing is
+// freed under a thread using another handle.  Names are handed out of
+// these handles as copies, so nothing points into a directory moved.
+
+static SboxStaticMutex budget_lock = SBOX_STATIC_MUTEX_INIT;
+static unsigned long   budget_limit = (unsigned long) -1;
+static unsigned long   budget_used;
+static SboxHandle     *budget_list;
+
+// entries in the directory, counting the meta item's
+static uint32 num_entries(SboxHandle *sbox)
+{
+   return sbox->num_items + (sbox->meta_size != 0);
+}
+
+// keep only where each entry is, and read them from the file
+static void budget_demote(SboxHandle *sbox)
+{
+   uint32 i, n = num_entries(sbox);
+   unsigned char *base = (unsigned char *) sbox->directory[0];
+   uint32 *index;
+
+   index = malloc(n * sizeof(index[0]));
+   if (index == NULL) return;
+   for (i=0; i < n; ++i)
+      index[i] = sbox->diroff + (uint32) ((unsigned char *) sbox->directory[i] - base);
+   sbox_cleanup(sbox);                 // the copy of the directory
+   free(sbox->directory);
+   sbox->directory = NULL;
+   sbox->directory_index = index;
+   sbox->demoted = 1;
+}
+
+static void budget_promote(SboxHandle *sbox)
+{
+   SboxResultCode result;
+   uint32 *index = sbox->directory_index, items = sbox->num_items;
+
+   sbox_cleanup(sbox);                 // the last name compared
+   sbox->directory_index = NULL;
+   if (sbox->trusted)
+      result = trusted_directory(sbox, sbox->diroff, sbox->dirsize);
    else
-      return load_directory(sbox, sd.diroff, sd.dirsize);
+      result = load_directory(sbox, sbox->diroff, sbox->dirsize);
+   sbox->num_items = items;            // the count included the meta item
+   if (result != SBOX_OK) {
+      if (sbox->directory) free(sbox->directory);
+      sbox->directory = NULL;
+      sbox_cleanup(sbox);
+      sbox->directory_index = index;
+      return;
+   }
+   free(index);
+   sbox->demoted = 0;
+}
+
+// take the handle's lock, and move its directory if the budget asks;
+// every use of 'directory' or 'directory_index' is between this and
+// budget_leave()
+static void budget_enter(SboxHandle *sbox)
+{
+   if (!sbox->budgeted) return;
+   sbox_mutex_lock(&sbox->lock);
+   if (sbox->demoted != sbox->want_demoted) {
+      if (sbox->want_demoted)
+         budget_demote(sbox);
+      else
+         budget_promote(sbox);
+      // out of memory; the next balance accounts for it
+      if (sbox->demoted != sbox->want_demoted) {
+         sbox->want_demoted  = sbox->demoted;
+         sbox->budget_failed = 1;
+      }
+   }
+}
+
+static void budget_leave(SboxHandle *sbox)
+{
+   if (sbox->budgeted)
+      sbox_mutex_unlock(&sbox->lock);
+}
+
+// ask a handle to move its directory, and count it as moved
+static void budget_mark(SboxHandle *sbox, int demote)
+{
+   sbox_mutex_lock(&sbox->lock);
+   sbox->want_demoted = demote;
+   sbox_mutex_unlock(&sbox->lock);
+   sbox->counted = !demote;
+   if (demote) budget_used -= sbox->memory;
+   else        budget_used += sbox->memory;
+}
+
+// demote the biggest directories until the rest fit, then promote
+// any that fit again; call with budget_lock held
+static void budget_balance(void)
+{
+   SboxHandle *s, *biggest;
+   int failed;
+
+   for (s = budget_list; s; s = s->budget_next) {
+      sbox_mutex_lock(&s->lock);
+      failed = s->budget_failed;
+      s->budget_failed = 0;
+      sbox_mutex_unlock(&s->lock);
+      if (failed)
+         budget_mark(s, s->counted);
+   }
+   while (budget_used > budget_limit) {
+      biggest = NULL;
+      for (s = budget_list; s; s = s->budget_next)
+         if (s->counted && !s->clones
+                        && (biggest == NULL || s->memory > biggest->memory))
+            biggest = s;
+      if (biggest == NULL) break;
+      budget_mark(biggest, 1);
+   }
+   for (s = budget_list; s; s = s->budget_next)
+      if (!s->counted && !s->clones && budget_used <= budget_limit
+                      && s->memory <= budget_limit - budget_used)
+         budget_mark(s, 0);
+}
+
+static void budget_add(SboxHandle *sbox)
+{
+   sbox->memory = num_entries(sbox) * sizeof(sbox->directory[0]);
+   if (sbox->free_me) sbox->memory += sbox->dirsize;
+   sbox_mutex_init(&sbox->lock);
+
+   sbox_static_lock(&budget_lock);
+   sbox->budget_prev = NULL;
+   sbox->budget_next = budget_list;
+   if (budget_list) budget_list->budget_prev = sbox;
+   budget_list = sbox;
+   sbox->budgeted = 1;
+   sbox->counted  = 1;
+   budget_used += sbox->memory;
+   budget_balance();
+   sbox_static_unlock(&budget_lock);
+}
+
+static void budget_remove(SboxHandle *sbox)
+{
+   sbox_static_lock(&budget_lock);
+   if (sbox->budget_prev) sbox->budget_prev->budget_next = sbox->budget_next;
+   else                   budget_list = sbox->budget_next;
+   if (sbox->budget_next) sbox->budget_next->budget_prev = sbox->budget_prev;
+   if (sbox->counted) budget_used -= sbox->memory;
+   budget_balance();
+   sbox_static_unlock(&budget_lock);
+   sbox->budgeted = 0;
+   sbox_mutex_destroy(&sbox->lock);
+}
+
+// the directory a clone borrows stays put while the clone is open
+static void budget_pin(SboxHandle *clone, int pin)
+{
+   SboxHandle *owner = clone->original;
+   while (owner->original) owner = owner->original;
+
+   sbox_static_lock(&budget_lock);
+   if (pin)
+      ++owner->clones;
+   else {
+      --owner->clones;
+      budget_balance();
+   }
+   sbox_static_unlock(&budget_lock);
+}
+
+SboxResultCode SboxReadSetMemoryBudget(unsigned long budget)
+{
+   sbox_static_lock(&budget_lock);
+   budget_limit = budget == SBOX_DIRECTORY_ALWAYS_IN_MEMORY ? (unsigned long) -1
+                                                            : budget;
+   budget_balance();
+   sbox_static_unlock(&budget_lock);
+   return SBOX_OK;
+}
+
+SboxResultCode SboxReadMemoryUsed(unsigned long *value)
+{
+   sbox_static_lock(&budget_lock);
+   *value = budget_used;
+   sbox_static_unlock(&budget_lock);
+   return SBOX_OK;
 }
 
 /////
@@ -357,57 +781,134 @@ static SboxResultCode read_directory(SboxHandle *sbox, char *sig)
 
 SboxResultCode SboxNumItems(uint32 *value, SboxHandle *sbox)
 {
+   SboxResultCode result = lazy_finish(sbox);
+   if (result != SBOX_OK) return result;
    *value = sbox->num_items;
    return SBOX_OK;
 }
 
-static SboxResultCode dirfield(uint32 *value, SboxHandle *sbox, uint32 item, int field)
+// an entry of a directory held in memory as stored, if it and its
+// name lie inside the directory
+static unsigned char *image_entry(SboxHandle *sbox, uint32 item)
+{
+   uint32 offset = sbox->directory_index[item] - sbox->diroff;
+   unsigned char *entry = sbox->dir_image + offset;
+   if (sbox->dirsize < INTSIZE*3 || offset > sbox->dirsize - INTSIZE*3
+         || little_int(entry + INTSIZE*2) > sbox->dirsize - INTSIZE*3 - offset)
+      return NULL;
+   return entry;
+}
+
+static SboxResultCode read_dirfield(uint32 *value, SboxHandle *sbox, uint32 item, int field)
 {
-   if (item >= sbox->num_items)
+   if (!have_item(sbox, item))
       return ERROR(SBOX_INVALID_ITEM, OUT_OF_RANGE);
 
    if (sbox->directory) {
       *value = (&sbox->directory[item]->offset)[field];
+   } else if (sbox->dir_image) {
+      unsigned char *entry = image_entry(sbox, item);
+      if (entry == NULL) return ERROR(DIRECTORY, NAMESIZE);
+      *value = little_int(entry + field*INTSIZE);
    } else {
       unsigned char buffer[4];
-      sbox_seek(sbox, sbox->directory_index[item] + field*INTSIZE);
-      if (fread(buffer, 4, 1, sbox->f) != 1)
+      if (sbox_read(sbox, sbox->directory_index[item] + field*INTSIZE,
+                    buffer, 4) != 4)
          return ERROR(SBOX_INVALID_ITEM, FREAD);
       *value = little_int(buffer);
    }
    return SBOX_OK;
 }
 
+static SboxResultCode dirfield(uint32 *value, SboxHandle *sbox, uint32 item, int field)
+{
+   SboxResultCode result;
+   budget_enter(sbox);
+   result = read_dirfield(value, sbox, item, field);
+   budget_leave(sbox);
+   return result;
+}
+
+static SboxItemMeta *find_meta(SboxHandle *sbox, uint32 item)
+{
+   uint32 lo = 0, hi = sbox->num_meta;
+   while (lo < hi) {
+      uint32 mid = lo + (hi - lo) / 2;
+      if (sbox->meta[mid].item < item)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   if (lo < sbox->num_meta && sbox->meta[lo].item == item)
+      return &sbox->meta[lo];
+   return NULL;
+}
+
 SboxResultCode SboxItemLoc(uint32 *value, SboxHandle *sbox, uint32 item)
 {
    return dirfield(value, sbox, item, 0);
 }
 
+// the size of the value, once decompressed
 SboxResultCode SboxItemSize(uint32 *value, SboxHandle *sbox, uint32 item)
+{
+   SboxItemMeta *meta = find_meta(sbox, item);
+   if (meta && (meta->flags & SBOX_ITEM_PACKED)) {
+      *value = meta->size;
+      return SBOX_OK;
+   }
+   return dirfield(value, sbox, item, 1);
+}
+
+// the number of bytes the value takes up in the file
+SboxResultCode SboxItemStoredSize(uint32 *value, SboxHandle *sbox, uint32 item)
 {
    return dirfield(value, sbox, item, 1);
 }
 
+// 1 if the value is stored compressed, so reading it decodes it
+SboxResultCode SboxItemPacked(uint32 *value, SboxHandle *sbox, uint32 item)
+{
+   SboxItemMeta *meta;
+   if (!have_item(sbox, item))
+      return ERROR(SBOX_INVALID_ITEM, OUT_OF_RANGE);
+   meta = find_meta(sbox, item);
+   *value = meta && (meta->flags & SBOX_ITEM_PACKED);
+   return SBOX_OK;
+}
+
+SboxResultCode SboxItemStoredForm(SboxItemForm *form, SboxHandle *sbox, uint32 item)
+{
+   SboxItemMeta *meta;
+   SboxResultCode result = SboxItemSize(&form->size, sbox, item);
+   if (result != SBOX_OK) return result;
+   meta = find_meta(sbox, item);
+   form->encoding = meta ? meta->flags & SBOX_ITEM_PACKED : 0;
+   form->has_crc  = meta && (meta->flags & SBOX_ITEM_CRC);
+   form->crc      = form->has_crc ? meta->crc : 0;
+   return SBOX_OK;
+}
+
 SboxResultCode SboxNameSize(uint32 *value, SboxHandle *sbox, uint32 item)
 {
    return dirfield(value, sbox, item, 2);
 }
 
-#ifndef min
-#define min(x,y) ((x) < (y) ? (x) : (y))
-#endif
-
-SboxResultCode SboxNameData(void **value, SboxHandle *sbox, uint32 item)
+static SboxResultCode read_name(void **value, SboxHandle *sbox, uint32 item)
 {
-   if (item >= sbox->num_items)
+   if (!have_item(sbox, item))
       return ERROR(SBOX_INVALID_ITEM, OUT_OF_RANGE);
 
    if (sbox->directory) {
       *value = &sbox->directory[item]->name;
+   } else if (sbox->dir_image) {
+      unsigned char *entry = image_entry(sbox, item);
+      if (entry == NULL) return ERROR(DIRECTORY, NAMESIZE);
+      *value = entry + INTSIZE*3;
    } else {
       uint32 size;
       SboxResultCode result;
-      result = SboxNameSize(&size, sbox, item);
+      result = read_dirfield(&size, sbox, item, 2);
       if (result != SBOX_OK) return result;
       if (size == 0) {
          *value = NULL;
@@ -416,8 +917,8 @@ SboxResultCode SboxNameData(void **value, SboxHandle *sbox, uint32 item)
          sbox_cleanup(sbox);
          sbox->free_me = malloc(size);
          if (sbox->free_me == NULL)    return ERROR(OOM, DIR_MEM);
-         sbox_seek(sbox, sbox->directory_index[item] + 3*INTSIZE);
-         if (fread(sbox->free_me, size, 1, sbox->f) != 1)
+         if (sbox_read(sbox, sbox->directory_index[item] + 3*INTSIZE,
+                       sbox->free_me, size) != size)
             return ERROR(DIRECTORY, FREAD);
          *value = sbox->free_me;
       }
@@ -425,121 +926,1403 @@ SboxResultCode SboxNameData(void **value, SboxHandle *sbox, uint32 item)
    return SBOX_OK;
 }
 
-SboxResultCode SboxNameBuffer(void *buffer, uint32 bufsize, SboxHandle *sbox, uint32 item)
+static SboxResultCode read_name_buffer(void *buffer, uint32 bufsize,
+                                       SboxHandle *sbox, uint32 item)
 {
-   if (item >= sbox->num_items)
+   if (!have_item(sbox, item))
       return ERROR(SBOX_INVALID_ITEM, OUT_OF_RANGE);
 
    if (sbox->directory) {
       bufsize = min(bufsize, sbox->directory[item]->namesize);
       memcpy(buffer, sbox->directory[item]->name, bufsize);
+   } else if (sbox->dir_image) {
+      unsigned char *entry = image_entry(sbox, item);
+      if (entry == NULL) return ERROR(DIRECTORY, NAMESIZE);
+      bufsize = min(bufsize, little_int(entry + INTSIZE*2));
+      memcpy(buffer, entry + INTSIZE*3, bufsize);
    } else {
       SboxResultCode result;
       uint32 size;
-      result = SboxNameSize(&size, sbox, item);
+      result = read_dirfield(&size, sbox, item, 2);
       if (result != SBOX_OK) return result;
       bufsize = min(bufsize, size);
-      sbox_seek(sbox, sbox->directory_index[item] + 3*INTSIZE);
-      if (fread(buffer, bufsize, 1, sbox->f) != 1)
+      if (sbox_read(sbox, sbox->directory_index[item] + 3*INTSIZE,
+                    buffer, bufsize) != bufsize)
          return ERROR(DIRECTORY, FREAD);
    }
    return SBOX_OK;
 }
 
-SboxResultCode SboxSeekItem(SboxHandle *sbox, uint32 item, uint32 offset)
+SboxResultCode SboxNameBuffer(void *buffer, uint32 bufsize, SboxHandle *sbox, uint32 item)
 {
-   uint32 where;
    SboxResultCode result;
+   budget_enter(sbox);
+   result = read_name_buffer(buffer, bufsize, sbox, item);
+   budget_leave(sbox);
+   return result;
+}
 
-   result = SboxItemLoc(&where, sbox, item);
+// the directory of a budgeted sbox may move before the next call, so
+// the names it hands out are copies, good until the next one
+static SboxResultCode copy_name(void **value, SboxHandle *sbox, uint32 item)
+{
+   SboxResultCode result;
+   uint32 size;
+
+   result = read_dirfield(&size, sbox, item, 2);
    if (result != SBOX_OK) return result;
-   sbox_seek(sbox, where+offset);
-   return result;
+   if (size > sbox->name_max) {
+      unsigned char *p = realloc(sbox->name_copy, size);
+      if (p == NULL)                   return ERROR(OOM, DIR_MEM);
+      sbox->name_copy = p;
+      sbox->name_max  = size;
+   }
+   result = read_name_buffer(sbox->name_copy, size, sbox, item);
+   if (result != SBOX_OK) return result;
+   *value = size ? sbox->name_copy : NULL;
+   return SBOX_OK;
 }
 
-FILE *SboxFileHandle(SboxHandle *sbox)
+SboxResultCode SboxNameData(void **value, SboxHandle *sbox, uint32 item)
 {
-   return sbox->f;
+   SboxResultCode result;
+   budget_enter(sbox);
+   if (sbox->budgeted)
+      result = copy_name(value, sbox, item);
+   else
+      result = read_name(value, sbox, item);
+   budget_leave(sbox);
+   return result;
 }
 
-uint32 SboxReadItem(void *buffer, uint32 bufsize,
-                            SboxHandle *sbox, uint32 item, uint32 offset)
+// the whole directory in one block: 'n' SboxListEntries, then the names
+// one after another; an on-disk directory is read into the block with
+// one read, and the names slid down over the entries' headers
+SboxResultCode SboxListNames(char **names, SboxListEntry **entries, SboxHandle *sbox)
 {
-   uint32 size;
-   SboxResultCode result = SboxItemSize(&size, sbox, item);
-   if (result != SBOX_OK) return 0;
+   SboxResultCode result;
+   SboxListEntry *list, *shrunk;
+   unsigned char *raw;
+   uint32 i, n, at, namesize, total = 0;
+   char *text;
 
-   // check that offset is not past end of item
-   if (offset >= size)    return 0;
+   result = SboxNumItems(&n, sbox);
+   if (result != SBOX_OK) return result;
 
-   // determine how much data is left to be read, and reduce bufsize to match
-   bufsize = min(bufsize, size - offset);
+   if (sbox->directory || sbox->dir_image) {
+      for (i=0; i < n; ++i) {
+         result = SboxNameSize(&namesize, sbox, i);
+         if (result != SBOX_OK) return result;
+         total += namesize;
+      }
+      list = malloc(n * sizeof(list[0]) + total + 1);
+      if (list == NULL)                    return ERROR(OOM, DIR_MEM);
+      text = (char *) (list + n);
+      for (i=0, at=0; i < n; ++i) {
+         SboxItemLoc(&list[i].offset, sbox, i);
+         SboxItemStoredSize(&list[i].size, sbox, i);
+         SboxNameSize(&list[i].namesize, sbox, i);
+         SboxNameBuffer(text + at, list[i].namesize, sbox, i);
+         list[i].name = at;
+         at += list[i].namesize;
+      }
+   } else {
+      list = malloc(n * sizeof(list[0]) + sbox->dirsize + 1);
+      if (list == NULL)                    return ERROR(OOM, DIR_MEM);
+      text = (char *) (list + n);
+      raw  = (unsigned char *) text;
+      if (sbox_read(sbox, sbox->diroff, raw, sbox->dirsize) != sbox->dirsize) {
+         free(list);
+         return ERROR(DIRECTORY, FREAD);
+      }
+      // a name never moves past its own entry, so the entries not yet
+      // reached are intact
+      for (i=0, at=0, total=0; i < n; ++i) {
+         if (sbox->dirsize - at < INTSIZE*3) break;
+         namesize = little_int(raw + at + INTSIZE*2);
+         if (namesize > sbox->dirsize - at - INTSIZE*3) break;
+         list[i].offset   = little_int(raw + at);
+         list[i].size     = little_int(raw + at + INTSIZE);
+         list[i].namesize = namesize;
+         list[i].name     = total;
+         memmove(text + total, raw + at + INTSIZE*3, namesize);
+         total += namesize;
+         at += offset_to_next_item(namesize);
+      }
+      if (i < n) {
+         free(list);
+         return ERROR(DIRECTORY, NAMESIZE);
+      }
+      shrunk = realloc(list, n * sizeof(list[0]) + total + 1);
+      if (shrunk) list = shrunk;
+      text = (char *) (list + n);
+   }
+   *entries = list;
+   *names   = text;
+   return SBOX_OK;
+}
 
-   // seek to the data
-   result = SboxSeekItem(sbox, item, offset);
-   if (result != SBOX_OK) return 0;
+/////
+//
+// streaming the directory
+//
+// An iterator reads the directory from the file in big blocks (or
+// straight out of the mapping), whatever the sbox keeps of it, so one
+// pass over every entry costs a sequential read and a block of memory.
 
-   // read it and return number of bytes read
-   return fread(buffer, 1, bufsize, sbox->f);
+#define DIR_ITER_BLOCK   (1 << 20)
+
+SboxResultCode SboxDirIterBegin(SboxDirIter **iter, SboxHandle *sbox)
+{
+   SboxDirIter *it = malloc(sizeof(*it));
+   if (it == NULL) return ERROR(OOM, HANDLE_MEM);
+   it->sbox      = sbox;
+   it->block     = NULL;
+   it->block_max = 0;
+   it->start     = 0;
+   it->filled    = 0;
+   it->next      = 0;
+   it->item      = 0;
+   if (sbox->io->map) {
+      it->block  = sbox->io->map + sbox->start + sbox->diroff;
+      it->filled = sbox->dirsize;
+   }
+   *iter = it;
+   return SBOX_OK;
 }
 
-static void sbox_initialize(SboxHandle *sbox)
+// get the 'size' bytes of the directory at it->next into the block;
+// the caller has checked they're in the directory
+static SboxResultCode dir_iter_fill(SboxDirIter *it, uint32 size)
 {
-   sbox->num_items       = 0;
+   SboxHandle *sbox = it->sbox;
+   unsigned char *block;
+   uint32 want;
 
-   sbox->directory       = NULL;
-   sbox->directory_index = NULL;
-   sbox->free_me         = NULL;
-   sbox->f               = NULL;
+   if (it->next - it->start <= it->filled
+         && size <= it->filled - (it->next - it->start))
+      return SBOX_OK;
+   if (sbox->io->map)                        return ERROR(DIRECTORY, NAMESIZE);
+
+   want = min(sbox->dirsize - it->next, size > DIR_ITER_BLOCK ? size : DIR_ITER_BLOCK);
+   if (want > it->block_max) {
+      block = realloc(it->block, want);
+      if (block == NULL)                     return ERROR(OOM, DIR_MEM);
+      it->block     = block;
+      it->block_max = want;
+   }
+   it->start  = it->next;
+   it->filled = 0;
+   if (sbox_read(sbox, sbox->diroff + it->next, it->block, want) != want)
+                                             return ERROR(DIRECTORY, FREAD);
+   it->filled = want;
+   return SBOX_OK;
 }
 
-static void sbox_free(SboxHandle *sbox)
+// entry->item is SBOX_NOT_FOUND once the last item has been returned
+SboxResultCode SboxDirIterNext(SboxDirEntry *entry, SboxDirIter *it)
 {
-   if (sbox->directory)        free(sbox->directory);
-   if (sbox->directory_index)  free(sbox->directory_index);
-   if (sbox->free_me)          free(sbox->free_me);
-   sbox_initialize(sbox);
-   free(sbox);
+   SboxHandle *sbox = it->sbox;
+   SboxResultCode result;
+   uint32 namesize, left;
+   unsigned char *p;
+
+   entry->item = SBOX_NOT_FOUND;
+   if (it->next >= sbox->dirsize)            return SBOX_OK;
+   left = sbox->dirsize - it->next;
+   if (left < INTSIZE*3)                     return ERROR(DIRECTORY, DIRSIZE_MATCH);
+
+   result = dir_iter_fill(it, INTSIZE*3);
+   if (result != SBOX_OK) return result;
+   namesize = little_int(it->block + (it->next - it->start) + INTSIZE*2);
+   if (namesize > left - INTSIZE*3)          return ERROR(DIRECTORY, NAMESIZE);
+   result = dir_iter_fill(it, INTSIZE*3 + namesize);
+   if (result != SBOX_OK) return result;
+   p = it->block + (it->next - it->start);
+
+   // the hidden meta item is the last entry
+   if (sbox->meta_size && offset_to_next_item(namesize) >= left
+         && namesize == SBOX_META_NAMESIZE
+         && !memcmp(p + INTSIZE*3, SBOX_META_NAME, SBOX_META_NAMESIZE)) {
+      it->next = sbox->dirsize;
+      return SBOX_OK;
+   }
+
+   entry->item     = it->item++;
+   entry->offset   = little_int(p);
+   entry->size     = little_int(p + INTSIZE);
+   entry->namesize = namesize;
+   entry->name     = p + INTSIZE*3;
+   it->next += offset_to_next_item(namesize);
+   return SBOX_OK;
 }
 
-SboxResultCode SboxReadClose(SboxHandle *sbox)
+SboxResultCode SboxDirIterEnd(SboxDirIter *it)
 {
-   if (sbox->close_file)
-      fclose(sbox->f);
-   sbox_free(sbox);
+   if (it->block_max) free(it->block);
+   free(it);
    return SBOX_OK;
 }
 
-SboxResultCode SboxReadOpenFromFileBlock(SboxHandle **handle,
-          FILE *f, uint32 offset, uint32 size, int close, char *sig)
+SboxResultCode SboxSeekItem(SboxHandle *sbox, uint32 item, uint32 offset)
 {
+   uint32 where;
    SboxResultCode result;
-   SboxHandle *sbox;
-   if (f == NULL)
-      return ERROR(SBOX_INVALID_FILE_OPEN, NO_FILE);
 
-   sbox = malloc(sizeof(SboxHandle));
-   if (!sbox) {
-      if (close) fclose(f);
-      return ERROR(OOM, HANDLE_MEM);
-   }
+   result = SboxItemLoc(&where, sbox, item);
+   if (result != SBOX_OK) return result;
+   sbox_seek(sbox, where+offset);
+   return result;
+}
 
-   sbox_initialize(sbox);
+FILE *SboxFileHandle(SboxHandle *sbox)
+{
+   return sbox->io->f;
+}
 
-   sbox->start      = offset;
-   sbox->length     = size;
-   sbox->f          = f;
-   sbox->close_file = close;
+// read 'size' stored bytes of an item starting at 'offset'
+static int read_range(SboxHandle *sbox, uint32 item, uint32 offset,
+                      void *dest, uint32 size)
+{
+   uint32 where;
+   if (SboxItemLoc(&where, sbox, item) != SBOX_OK
+         || sbox_read(sbox, where+offset, dest, size) != size) {
+      ERROR(SBOX_INVALID_ITEM, FREAD);
+      return 1;
+   }
+   return 0;
+}
+
+// read the stored bytes of an item into memory
+static unsigned char *read_stored(SboxHandle *sbox, uint32 item, uint32 *size)
+{
+   unsigned char *data;
+   if (SboxItemStoredSize(size, sbox, item) != SBOX_OK) return NULL;
+   data = malloc(*size ? *size : 1);
+   if (data == NULL) {
+      ERROR(OOM, DIR_MEM);
+      return NULL;
+   }
+   if (read_range(sbox, item, 0, data, *size)) {
+      free(data);
+      return NULL;
+   }
+   return data;
+}
+
+/////
+//
+// compressed items
+//
+// A compressed item is either one sboxlz block, or a series of chunks
+// compressed separately, followed by the stored end offset of every
+// chunk and the (uncompressed) chunk size.  A chunk whose stored size
+// equals its size isn't compressed.  Reading part of an item only
+// decompresses the chunks it covers, and the last chunk decompressed is
+// kept, so reading an item in small pieces decompresses each chunk once.
+
+#define NO_ITEM   0xffffffff
+
+static int grow_chunk_table(SboxChunkCache *cc, uint32 count)
+{
+   uint32 *end;
+   if (count <= cc->max) return 0;
+   end = realloc(cc->end, count * sizeof(end[0]));
+   if (end == NULL) return 1;
+   cc->end = end;
+   cc->max = count;
+   return 0;
+}
+
+static SboxResultCode load_chunk_table(SboxHandle *sbox, uint32 item, SboxItemMeta *meta)
+{
+   SboxChunkCache *cc = &sbox->chunks;
+   unsigned char buffer[INTSIZE], *table;
+   uint32 i, stored, count, chunk;
+   SboxResultCode result;
+
+   if (cc->item == item) return SBOX_OK;
+   cc->item = NO_ITEM;
+   cc->data_chunk = NO_ITEM;
+
+   result = SboxItemStoredSize(&stored, sbox, item);
+   if (result != SBOX_OK) return result;
+
+   if (!(meta->flags & SBOX_ITEM_CHUNKED)) {
+      if (grow_chunk_table(cc, 1))          return ERROR(OOM, DIR_MEM);
+      cc->end[0] = stored;
+      cc->count  = 1;
+      cc->size   = meta->size;
+      cc->item   = item;
+      return SBOX_OK;
+   }
+
+   if (stored < INTSIZE)                    return ERROR(SBOX_INVALID_ITEM, CORRUPT);
+   if (read_range(sbox, item, stored-INTSIZE, buffer, INTSIZE))
+                                            return SBOX_INVALID_ITEM;
+   chunk = little_int(buffer);
+   if (chunk == 0)                          return ERROR(SBOX_INVALID_ITEM, CORRUPT);
+   count = meta->size / chunk + (meta->size % chunk != 0);
+   if (count == 0 || count > stored / INTSIZE - 1)
+                                            return ERROR(SBOX_INVALID_ITEM, CORRUPT);
+
+   if (grow_chunk_table(cc, count))         return ERROR(OOM, DIR_MEM);
+   table = malloc(count * INTSIZE);
+   if (table == NULL)                       return ERROR(OOM, DIR_MEM);
+   if (read_range(sbox, item, stored - (count+1)*INTSIZE, table, count*INTSIZE)) {
+      free(table);
+      return SBOX_INVALID_ITEM;
+   }
+   for (i=0; i < count; ++i)
+      cc->end[i] = little_int(table + i*INTSIZE);
+   free(table);
+
+   // every chunk must be no bigger stored than uncompressed, and they
+   // must exactly fill the space before the table
+   for (i=0; i < count; ++i) {
+      uint32 start = i ? cc->end[i-1] : 0;
+      uint32 size  = i+1 < count ? chunk : meta->size - i*chunk;
+      if (cc->end[i] < start || cc->end[i] - start > size)
+         return ERROR(SBOX_INVALID_ITEM, CORRUPT);
+   }
+   if (cc->end[count-1] != stored - (count+1)*INTSIZE)
+      return ERROR(SBOX_INVALID_ITEM, CORRUPT);
+
+   cc->count = count;
+   cc->size  = chunk;
+   cc->item  = item;
+   return SBOX_OK;
+}
+
+// decompress chunk 'k' of the item whose table is loaded into 'dest'
+static int decode_chunk(SboxHandle *sbox, uint32 k, uint32 size, unsigned char *dest)
+{
+   SboxChunkCache *cc = &sbox->chunks;
+   uint32 start = k ? cc->end[k-1] : 0, stored = cc->end[k] - start;
+   unsigned char *packed;
+   int bad;
+
+   if (stored == size)
+      return read_range(sbox, cc->item, start, dest, size);
+
+   packed = malloc(stored ? stored : 1);
+   if (packed == NULL) { ERROR(OOM, DIR_MEM); return 1; }
+   bad = read_range(sbox, cc->item, start, packed, stored);
+   if (!bad && sbox_lz_decompress(dest, size, packed, stored)) {
+      ERROR(SBOX_INVALID_ITEM, CORRUPT);
+      bad = 1;
+   }
+   free(packed);
+   return bad;
+}
+
+static uint32 read_compressed(void *buffer, uint32 bufsize, SboxHandle *sbox,
+                              uint32 item, SboxItemMeta *meta, uint32 offset)
+{
+   SboxChunkCache *cc = &sbox->chunks;
+   unsigned char *out = buffer;
+   uint32 done = 0;
+
+   if (offset >= meta->size) return 0;
+   bufsize = min(bufsize, meta->size - offset);
+   if (load_chunk_table(sbox, item, meta) != SBOX_OK) return 0;
+
+   while (done < bufsize) {
+      uint32 k     = (offset + done) / cc->size;
+      uint32 first = k * cc->size;
+      uint32 size  = min(cc->size, meta->size - first);
+      uint32 skip  = offset + done - first;
+      uint32 take  = min(size - skip, bufsize - done);
+
+      if (skip == 0 && take == size) {
+         // whole chunk wanted; decompress in place
+         if (decode_chunk(sbox, k, size, out + done)) return 0;
+      } else {
+         if (cc->data_chunk != k) {
+            if (size > cc->data_max) {
+               free(cc->data);
+               cc->data = malloc(size);
+               cc->data_max = cc->data ? size : 0;
+               if (cc->data == NULL) { ERROR(OOM, DIR_MEM); return 0; }
+            }
+            cc->data_chunk = NO_ITEM;
+            if (decode_chunk(sbox, k, size, cc->data)) return 0;
+            cc->data_chunk = k;
+         }
+         memcpy(out + done, cc->data + skip, take);
+      }
+      done += take;
+   }
+   return bufsize;
+}
+
+/////
+//
+// checksums
+//
+// Items written with checksums on have the CRC32C of their stored data
+// among their attributes.  SboxVerifyItem() checks one on demand; with
+// SboxReadSetVerify(), SboxReadItem() checks each item the first time
+// it is read, at the cost of reading all of it then.
+
+#define VERIFY_BUFFER   65536
+
+static int crc_mismatch(SboxItemMeta *meta, uint32 crc)
+{
+   if (crc == meta->crc) return 0;
+   ERROR(SBOX_INVALID_ITEM, CORRUPT);
+   return 1;
+}
+
+// *checked is set to 1 if the item has a checksum and it matched, or
+// 0 if the item has no checksum
+SboxResultCode SboxVerifyItem(uint32 *checked, SboxHandle *sbox, uint32 item)
+{
+   SboxResultCode result;
+   SboxItemMeta *meta;
+   unsigned char *buffer;
+   uint32 size, done, crc = 0;
+
+   *checked = 0;
+   result = SboxItemStoredSize(&size, sbox, item);
+   if (result != SBOX_OK) return result;
+   meta = find_meta(sbox, item);
+   if (!meta || !(meta->flags & SBOX_ITEM_CRC)) return SBOX_OK;
+
+   buffer = malloc(min(size, VERIFY_BUFFER) + 1);
+   if (buffer == NULL)    return ERROR(OOM, DIR_MEM);
+   for (done=0; done < size; ) {
+      uint32 n = min(size - done, VERIFY_BUFFER);
+      if (read_range(sbox, item, done, buffer, n)) {
+         free(buffer);
+         return SBOX_INVALID_ITEM;
+      }
+      crc = sbox_crc32c(crc, buffer, n);
+      done += n;
+   }
+   free(buffer);
+
+   if (crc_mismatch(meta, crc)) return SBOX_INVALID_ITEM;
+   *checked = 1;
+   return SBOX_OK;
+}
+
+SboxResultCode SboxReadSetVerify(SboxHandle *sbox, int enable)
+{
+   if (enable && !sbox->verified) {
+      if (lazy_finish(sbox) != SBOX_OK) return SBOX_INVALID_DIRECTORY;
+      sbox->verified = calloc(sbox->num_items / 8 + 1, 1);
+      if (!sbox->verified) return ERROR(OOM, DIR_MEM);
+   }
+   sbox->verify = enable != 0;
+   return SBOX_OK;
+}
+
+#define is_verified(sbox,i)    ((sbox)->verified[(i) >> 3] &   (1 << ((i) & 7)))
+#define set_verified(sbox,i)   ((sbox)->verified[(i) >> 3] |=  (1 << ((i) & 7)))
+
+uint32 SboxReadItem(void *buffer, uint32 bufsize,
+                            SboxHandle *sbox, uint32 item, uint32 offset)
+{
+   uint32 size, where, checked, got;
+   SboxItemMeta *meta;
+   SboxResultCode result;
+   int verify = 0;
+
+   meta = find_meta(sbox, item);
+   if (sbox->verify && meta && (meta->flags & SBOX_ITEM_CRC)
+                    && !is_verified(sbox, item))
+      verify = 1;
+
+   if (meta && (meta->flags & SBOX_ITEM_PACKED)) {
+      if (verify) {
+         if (SboxVerifyItem(&checked, sbox, item) != SBOX_OK) return 0;
+         set_verified(sbox, item);
+      }
+      return read_compressed(buffer, bufsize, sbox, item, meta, offset);
+   }
+
+   result = SboxItemStoredSize(&size, sbox, item);
+   if (result != SBOX_OK) return 0;
+
+   // check that offset is not past end of item
+   if (offset >= size)    return 0;
+
+   // determine how much data is left to be read, and reduce bufsize to match
+   bufsize = min(bufsize, size - offset);
+
+   // reading all of it, check what was read instead of reading it twice
+   if (verify && (offset != 0 || bufsize != size)) {
+      if (SboxVerifyItem(&checked, sbox, item) != SBOX_OK) return 0;
+      set_verified(sbox, item);
+      verify = 0;
+   }
+
+   // find the data
+   result = SboxItemLoc(&where, sbox, item);
+   if (result != SBOX_OK) return 0;
+
+   // read it and return number of bytes read
+   got = sbox_read(sbox, where+offset, buffer, bufsize);
+   if (verify && got == size) {
+      if (crc_mismatch(meta, sbox_crc32c(0, buffer, size))) return 0;
+      set_verified(sbox, item);
+   }
+   return got;
+}
+
+uint32 SboxReadStored(void *buffer, uint32 bufsize,
+                            SboxHandle *sbox, uint32 item, uint32 offset)
+{
+   uint32 size, where;
+   if (SboxItemStoredSize(&size, sbox, item) != SBOX_OK) return 0;
+   if (offset >= size)    return 0;
+   bufsize = min(bufsize, size - offset);
+   if (SboxItemLoc(&where, sbox, item) != SBOX_OK) return 0;
+   return sbox_read(sbox, where+offset, buffer, bufsize);
+}
+
+// point straight at an item's data, if the sbox is in memory and the
+// item isn't compressed; the pointer is valid until the sbox is closed
+SboxResultCode SboxItemData(void **value, SboxHandle *sbox, uint32 item)
+{
+   uint32 where, size;
+   SboxItemMeta *meta;
+   SboxResultCode result;
+
+   result = SboxCheckItemRange(sbox, item);
+   if (result != SBOX_OK) return result;
+   meta = find_meta(sbox, item);
+   if (sbox->io->map == NULL || (meta && (meta->flags & SBOX_ITEM_PACKED)))
+      return ERROR(SBOX_INVALID_ITEM, NOT_MAPPED);
+
+   SboxItemLoc(&where, sbox, item);
+   SboxItemStoredSize(&size, sbox, item);
+   *value = sbox->io->map + sbox->start + where;
+
+   if (sbox->verify && meta && (meta->flags & SBOX_ITEM_CRC)
+                    && !is_verified(sbox, item)) {
+      if (crc_mismatch(meta, sbox_crc32c(0, *value, size)))
+         return SBOX_INVALID_ITEM;
+      set_verified(sbox, item);
+   }
+   return SBOX_OK;
+}
+
+/////
+//
+// copying items to file descriptors
+//
+
+#define COPY_BUFFER   65536
+
+// returns how many of the 'size' bytes were written
+static uint32 write_fd(int fd, unsigned char *data, uint32 size)
+{
+   uint32 done = 0;
+   while (done < size) {
+      int n = write(fd, data + done, min(size - done, 0x40000000));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      done += n;
+   }
+   return done;
+}
+
+// copy up to 'length' bytes of an item, starting 'offset' bytes into
+// it, to the current position of 'fd'; stored data goes straight from
+// memory or through the backend's send(), so never through a buffer of
+// ours; returns the number of bytes copied
+uint32 SboxCopyItemToFd(SboxHandle *sbox, uint32 item, uint32 offset,
+                        uint32 length, int fd)
+{
+   uint32 size, where, checked, done = 0;
+   unsigned char *buffer;
+   SboxItemMeta *meta;
+
+   if (SboxItemSize(&size, sbox, item) != SBOX_OK) return 0;
+   if (offset >= size)    return 0;
+   length = min(length, size - offset);
+
+   meta = find_meta(sbox, item);
+   if (!meta || !(meta->flags & SBOX_ITEM_PACKED)) {
+      if (SboxCheckItemRange(sbox, item) != SBOX_OK) return 0;
+      if (sbox->verify && meta && (meta->flags & SBOX_ITEM_CRC)
+                       && !is_verified(sbox, item)) {
+         if (SboxVerifyItem(&checked, sbox, item) != SBOX_OK) return 0;
+         set_verified(sbox, item);
+      }
+      SboxItemLoc(&where, sbox, item);
+      where += sbox->start + offset;
+      if (sbox->io->map)
+         return write_fd(fd, sbox->io->map + where, length);
+      if (sbox->io->send)
+         done = sbox->io->send(sbox->io, where, length, fd);
+   }
+
+   // compressed, or the kernel couldn't do it all
+   if (done == length)    return done;
+   buffer = malloc(min(length - done, COPY_BUFFER));
+   if (buffer == NULL) {
+      ERROR(OOM, DIR_MEM);
+      return done;
+   }
+   while (done < length) {
+      uint32 n = min(length - done, COPY_BUFFER), wrote;
+      if (SboxReadItem(buffer, n, sbox, item, offset + done) != n) break;
+      wrote = write_fd(fd, buffer, n);
+      done += wrote;
+      if (wrote != n) break;
+   }
+   free(buffer);
+   return done;
+}
+
+// SBOX_OK if an item's data lies between the header and the directory
+SboxResultCode SboxCheckItemRange(SboxHandle *sbox, uint32 item)
+{
+   SboxResultCode result;
+   uint32 loc, size, first = 16+INTSIZE*2, last = sbox->length - INTSIZE*2;
+
+   result = SboxItemLoc(&loc, sbox, item);
+   if (result == SBOX_OK)
+      result = SboxItemStoredSize(&size, sbox, item);
+   if (result != SBOX_OK) return result;
+   if (loc < first || loc > last || size > last - loc)
+      return ERROR(SBOX_INVALID_ITEM, OUT_OF_RANGE);
+
+   // the directory (with its header) may come before the data or after it
+   if (size != 0 && loc < sbox->diroff + sbox->dirsize
+                 && loc + size > sbox->diroff - INTSIZE*2)
+      return ERROR(SBOX_INVALID_ITEM, OUT_OF_RANGE);
+   return SBOX_OK;
+}
+
+/////
+//
+// find items by name
+//
+// Without an index, finding a name scans the directory.  The index is
+// an open-addressed hash table of the names; it is only read once it's
+// built, so threads sharing an sbox can look names up at once.
+
+// whether 'p' points into a mapped index file, so mustn't be freed
+static int in_index(SboxHandle *sbox, void *p)
+{
+   unsigned char *map = sbox->index_io ? sbox->index_io->map : NULL;
+   return map && (unsigned char *) p >= map
+              && (unsigned char *) p <  map + sbox->index_io->size(sbox->index_io);
+}
+
+static uint32 name_hash(void *name, uint32 size)
+{
+   unsigned char *p = name;
+   uint32 i, h = 2166136261u;          // FNV-1a
+   for (i=0; i < size; ++i)
+      h = (h ^ p[i]) * 16777619;
+   return h;
+}
+
+// compared in place, under the handle's lock, so the directory can't
+// move meanwhile and no copy is made
+static int name_is(SboxHandle *sbox, uint32 item, void *name, uint32 namelen)
+{
+   uint32 size;
+   void *data;
+   int same;
+   budget_enter(sbox);
+   same = read_dirfield(&size, sbox, item, 2) == SBOX_OK && size == namelen
+       && read_name(&data, sbox, item) == SBOX_OK
+       && (namelen == 0 || memcmp(data, name, namelen) == 0);
+   budget_leave(sbox);
+   return same;
+}
+
+// the slot holding 'name', or the empty slot where it would go, or
+// NO_ITEM if there's neither (only possible in a broken index file)
+static uint32 find_slot(SboxHandle *sbox, void *name, uint32 namelen, uint32 h)
+{
+   uint32 k, n;
+   for (n=0, k = h & sbox->name_mask; n <= sbox->name_mask;
+                                      ++n, k = (k+1) & sbox->name_mask)
+      if (sbox->names[k].item == NO_ITEM
+            || (sbox->names[k].hash == h
+                && name_is(sbox, sbox->names[k].item, name, namelen)))
+         return k;
+   return NO_ITEM;
+}
+
+SboxResultCode SboxReadSetNameIndex(SboxHandle *sbox, int enable)
+{
+   uint32 i, k, h, size, slots = 16, scratch_size = 0;
+   unsigned char *scratch = NULL;
+   SboxResultCode result = SBOX_OK;
+   void *name;
+
+   if (!enable || sbox->names) {
+      if (!enable && sbox->names) {
+         if (!in_index(sbox, sbox->names) && !sbox->names_borrowed)
+            free(sbox->names);
+         sbox->names = NULL;
+         sbox->names_borrowed = 0;
+      }
+      return SBOX_OK;
+   }
+
+   result = lazy_finish(sbox);
+   if (result != SBOX_OK) return result;
+   while (slots < sbox->num_items * 2 && slots < 0x80000000) slots *= 2;
+   sbox->names = malloc(slots * sizeof(sbox->names[0]));
+   if (sbox->names == NULL) return ERROR(OOM, DIRINDEX_MEM);
+   for (k=0; k < slots; ++k) {
+      sbox->names[k].hash = 0;
+      sbox->names[k].item = NO_ITEM;
+   }
+   sbox->name_mask = slots-1;
+
+   for (i=0; i < sbox->num_items && result == SBOX_OK; ++i) {
+      result = SboxNameSize(&size, sbox, i);
+      if (result == SBOX_OK)
+         result = SboxNameData(&name, sbox, i);
+      if (result != SBOX_OK) break;
+      // a name read from disk only lasts until the next one is read
+      if (sbox->directory == NULL && sbox->dir_image == NULL) {
+         if (size > scratch_size) {
+            unsigned char *p = realloc(scratch, size);
+            if (p == NULL) {
+               result = ERROR(OOM, DIRINDEX_MEM);
+               break;
+            }
+            scratch = p;
+            scratch_size = size;
+         }
+         memcpy(scratch, name, size);
+         name = scratch;
+      }
+      h = name_hash(name, size);
+      k = find_slot(sbox, name, size, h);
+      // the first item with a name is the one found
+      if (sbox->names[k].item == NO_ITEM) {
+         sbox->names[k].hash = h;
+         sbox->names[k].item = i;
+      }
+   }
+   free(scratch);
+
+   if (result != SBOX_OK) {
+      free(sbox->names);
+      sbox->names = NULL;
+   }
+   return result;
+}
+
+// *item is the first item called 'name', or SBOX_NOT_FOUND
+SboxResultCode SboxFindName(uint32 *item, SboxHandle *sbox, void *name, uint32 namelen)
+{
+   uint32 i, k;
+
+   if (sbox->names) {
+      k = find_slot(sbox, name, namelen, name_hash(name, namelen));
+      *item = k == NO_ITEM ? SBOX_NOT_FOUND : sbox->names[k].item;
+      return SBOX_OK;
+   }
+   for (i=0; have_item(sbox, i); ++i)
+      if (name_is(sbox, i, name, namelen)) {
+         *item = i;
+         return SBOX_OK;
+      }
+   *item = SBOX_NOT_FOUND;
+   return SBOX_OK;
+}
 
-   result = read_directory(sbox, sig);
+/////
+//
+// index files
+//
+// An index file holds what read_directory() works out, laid out so
+// that it can be mapped and used in place (see sboxtype.h); processes
+// opening the same sbox with it share one copy of the directory, and
+// none of them parse it.  Its arrays are used as they are, so only
+// little-endian hosts use index files.
+
+static int write_int(FILE *f, uint32 x)
+{
+   unsigned char buffer[INTSIZE];
+   buffer[0] = x; buffer[1] = x >> 8; buffer[2] = x >> 16; buffer[3] = x >> 24;
+   return fwrite(buffer, 1, INTSIZE, f) == INTSIZE;
+}
+
+SboxResultCode SboxReadSaveIndex(SboxHandle *sbox, char *filename)
+{
+   SboxResultCode result;
+   unsigned char *dir;
+   uint32 i, offset, entries, slots;
+   int ok;
+   FILE *f;
+
+   result = SboxReadSetNameIndex(sbox, 1);
+   if (result != SBOX_OK) return result;
+
+   dir = malloc(sbox->dirsize + 1);
+   if (dir == NULL) return ERROR(OOM, DIR_MEM);
+   if (sbox_read(sbox, sbox->diroff, dir, sbox->dirsize) != sbox->dirsize) {
+      free(dir);
+      return ERROR(DIRECTORY, FREAD);
+   }
+   f = fopen(filename, "wb");
+   if (f == NULL) {
+      free(dir);
+      return ERROR(SBOX_INVALID_FILE_OPEN, NO_FILE);
+   }
+
+   entries = sbox->num_items + (sbox->meta_size != 0);
+   slots   = sbox->name_mask + 1;
+   ok = fwrite(SBOX_INDEX_MAGIC, 1, 4, f) == 4
+     && write_int(f, SBOX_INDEX_VERSION)
+     && write_int(f, sbox->length)
+     && write_int(f, sbox->diroff)
+     && write_int(f, sbox->dirsize)
+     && write_int(f, sbox->num_items)
+     && write_int(f, entries)
+     && write_int(f, sbox->num_meta)
+     && write_int(f, slots)
+     && write_int(f, sbox->meta_size)
+     && write_int(f, sbox_crc32c(0, dir, sbox->dirsize));
+
+   // entries are found the way scan_directory() finds them
+   for (i=0, offset=0; ok && i < entries; ++i) {
+      ok = write_int(f, sbox->diroff + offset);
+      offset += offset_to_next_item(little_int(dir + offset + INTSIZE*2));
+   }
+   for (i=0; ok && i < sbox->num_meta; ++i)
+      ok = write_int(f, sbox->meta[i].item) && write_int(f, sbox->meta[i].flags)
+        && write_int(f, sbox->meta[i].size) && write_int(f, sbox->meta[i].crc);
+   for (i=0; ok && i < slots; ++i)
+      ok = write_int(f, sbox->names[i].hash) && write_int(f, sbox->names[i].item);
+   if (ok)
+      ok = fwrite(dir, 1, sbox->dirsize, f) == sbox->dirsize;
+   free(dir);
+
+   if (fclose(f) != 0 || !ok)
+      return ERROR(SBOX_INVALID_FILE_OPEN, FWRITE);
+   return SBOX_OK;
+}
+
+// take 'count' array elements of 'size' bytes from the 'rest' of a file
+static int index_take(uint32 *rest, uint32 count, uint32 size)
+{
+   if (count > *rest / size) return 0;
+   *rest -= count * size;
+   return 1;
+}
+
+// *crc is the CRC32C of the directory as stored; 0 if it can't be read
+static int directory_crc(SboxHandle *sbox, uint32 *crc)
+{
+   unsigned char *buffer;
+   uint32 done, n;
+
+   *crc = 0;
+   if (sbox->io->map) {
+      *crc = sbox_crc32c(0, sbox->io->map + sbox->start + sbox->diroff, sbox->dirsize);
+      return 1;
+   }
+   buffer = malloc(min(sbox->dirsize, VERIFY_BUFFER) + 1);
+   if (buffer == NULL) return 0;
+   for (done=0; done < sbox->dirsize; done += n) {
+      n = min(sbox->dirsize - done, VERIFY_BUFFER);
+      if (sbox_read(sbox, sbox->diroff + done, buffer, n) != n) {
+         free(buffer);
+         return 0;
+      }
+      *crc = sbox_crc32c(*crc, buffer, n);
+   }
+   free(buffer);
+   return 1;
+}
+
+// use an index file instead of reading the directory; returns 0 if
+// there isn't one which matches the sbox (its directory's checksum
+// catches one rewritten with the same size and directory location)
+static int load_index(SboxHandle *sbox, char *filename)
+{
+   uint32 items, entries, metas, slots, rest, crc;
+   unsigned char *p;
+   SboxIO *io;
+
+   if (!little_endian_host()) return 0;
+   io = SboxIOMapFile(filename);
+   if (io == NULL) return 0;
+   p = io->map;
+   rest = io->size(io) - SBOX_INDEX_HEADER;
+
+   if (io->size(io) < SBOX_INDEX_HEADER || memcmp(p, SBOX_INDEX_MAGIC, 4)
+         || little_int(p+4)  != SBOX_INDEX_VERSION
+         || little_int(p+8)  != sbox->length
+         || little_int(p+12) != sbox->diroff
+         || little_int(p+16) != sbox->dirsize
+         || !directory_crc(sbox, &crc) || little_int(p+40) != crc) {
+      io->close(io);
+      return 0;
+   }
+   items   = little_int(p+20);
+   entries = little_int(p+24);
+   metas   = little_int(p+28);
+   slots   = little_int(p+32);
+
+   // the arrays must fill the file exactly
+   if (entries > sbox->dirsize / (INTSIZE*3) || items > entries
+         || entries - items > 1 || metas > items
+         || (slots & (slots-1)) != 0
+         || !index_take(&rest, entries, INTSIZE)
+         || !index_take(&rest, metas, sizeof(SboxItemMeta))
+         || !index_take(&rest, slots, sizeof(SboxNameSlot))
+         || rest != sbox->dirsize) {
+      io->close(io);
+      return 0;
+   }
+
+   p += SBOX_INDEX_HEADER;
+   sbox->directory_index = (uint32 *) p;
+   p += entries * INTSIZE;
+   sbox->meta      = metas ? (SboxItemMeta *) p : NULL;
+   sbox->num_meta  = metas;
+   sbox->meta_size = little_int(io->map+36);
+   p += metas * sizeof(SboxItemMeta);
+   sbox->names     = slots ? (SboxNameSlot *) p : NULL;
+   sbox->name_mask = slots - 1;
+   p += slots * sizeof(SboxNameSlot);
+   sbox->dir_image = p;
+   sbox->num_items = items;
+   sbox->index_io  = io;
+   return 1;
+}
+
+/////
+//
+// account for bytes not belonging to any item
+//
+
+typedef struct
+{
+   uint32 offset;
+   uint32 size;
+} SboxExtent;
+
+static int extent_compare(const void *p, const void *q)
+{
+   const SboxExtent *a = p, *b = q;
+   if (a->offset != b->offset) return a->offset < b->offset ? -1 : 1;
+   return 0;
+}
+
+// everything that isn't the header, the directory, the tail, or
+// inside some item is dead space, e.g. left behind by deletions
+SboxResultCode SboxDeadSpace(uint32 *value, SboxHandle *sbox)
+{
+   SboxResultCode result;
+   SboxExtent *ext;
+   uint32 i, used, end;
+
+   result = lazy_finish(sbox);
+   if (result != SBOX_OK) return result;
+
+   // header, directory header, directory, tail, and the meta item
+   used = 16+INTSIZE*2 + INTSIZE*2 + sbox->dirsize + INTSIZE*2 + sbox->meta_size;
+
+   if (sbox->num_items != 0) {
+      ext = malloc(sbox->num_items * sizeof(ext[0]));
+      if (ext == NULL)                        return ERROR(OOM, DIR_MEM);
+
+      for (i=0; i < sbox->num_items; ++i) {
+         result = SboxItemLoc(&ext[i].offset, sbox, i);
+         if (result == SBOX_OK)
+            result = SboxItemStoredSize(&ext[i].size, sbox, i);
+         if (result != SBOX_OK) { free(ext); return result; }
+      }
+      qsort(ext, sbox->num_items, sizeof(ext[0]), extent_compare);
+
+      // union of the item extents, so shared data counts once
+      end = 0;
+      for (i=0; i < sbox->num_items; ++i) {
+         uint32 start = ext[i].offset, stop = ext[i].offset + ext[i].size;
+         if (start < end) start = end;
+         if (stop > start) {
+            used += stop - start;
+            end = stop;
+         }
+      }
+      free(ext);
+   }
+
+   *value = used < sbox->length ? sbox->length - used : 0;
+   return SBOX_OK;
+}
+
+/////
+//
+// item attributes
+//
+// Attributes that don't fit in the directory, e.g. compression, are
+// kept in a meta item which sboxwrit adds as the last item, and which
+// is hidden from the client.
+
+static SboxResultCode read_meta(SboxHandle *sbox)
+{
+   SboxResultCode result;
+   unsigned char name[SBOX_META_NAMESIZE], *data;
+   uint32 item, namesize, size;
+
+   if (sbox->num_items == 0) return SBOX_OK;
+   item = sbox->num_items - 1;
+
+   result = SboxNameSize(&namesize, sbox, item);
+   if (result != SBOX_OK)                   return result;
+   if (namesize != SBOX_META_NAMESIZE)      return SBOX_OK;
+   result = SboxNameBuffer(name, namesize, sbox, item);
+   if (result != SBOX_OK)                   return result;
+   if (memcmp(name, SBOX_META_NAME, namesize)) return SBOX_OK;
+
+   data = read_stored(sbox, item, &size);
+   if (data == NULL)                        return SBOX_INVALID_DIRECTORY;
+
+   result = parse_meta(sbox, data, size, item);
+   free(data);
+   if (result == SBOX_OK)
+      sbox->num_items = item;
+   return result;
+}
+
+// the meta item's records must be for items below 'limit'
+static SboxResultCode parse_meta(SboxHandle *sbox, unsigned char *data,
+                                 uint32 size, uint32 limit)
+{
+   SboxResultCode result = SBOX_OK;
+   uint32 i, recsize = 0, count = 0;
+   unsigned char *p;
+
+   if (size < INTSIZE*3 || memcmp(data, SBOX_META_MAGIC, 4))
+      result = ERROR(DIRECTORY, META);
+   else {
+      recsize = little_int(data+INTSIZE);
+      count   = little_int(data+INTSIZE*2);
+      if (recsize < SBOX_META_RECORD_MIN || (recsize & INTMOD)
+            || count > (size - INTSIZE*3) / recsize)
+         result = ERROR(DIRECTORY, META);
+   }
+   if (result == SBOX_OK && count != 0) {
+      sbox->meta = malloc(count * sizeof(sbox->meta[0]));
+      if (sbox->meta == NULL)
+         result = ERROR(OOM, DIR_MEM);
+   }
+   if (result != SBOX_OK) return result;
+
+   // records must be sorted, so they can be binary searched
+   p = data + INTSIZE*3;
+   for (i=0; i < count; ++i, p += recsize) {
+      sbox->meta[i].item  = little_int(p);
+      sbox->meta[i].flags = little_int(p+INTSIZE);
+      sbox->meta[i].size  = little_int(p+INTSIZE*2);
+      sbox->meta[i].crc   = recsize >= INTSIZE*4 ? little_int(p+INTSIZE*3) : 0;
+      if (sbox->meta[i].item >= limit
+            || (recsize < INTSIZE*4 && (sbox->meta[i].flags & SBOX_ITEM_CRC))
+            || (i > 0 && sbox->meta[i].item <= sbox->meta[i-1].item))
+         return ERROR(DIRECTORY, META);
+   }
+
+   sbox->num_meta  = count;
+   sbox->meta_size = size;
+   return SBOX_OK;
+}
+
+static void sbox_initialize(SboxHandle *sbox)
+{
+   sbox->num_items       = 0;
+   sbox->diroff          = 0;
+   sbox->dirsize         = 0;
+
+   sbox->directory       = NULL;
+   sbox->directory_index = NULL;
+   sbox->free_me         = NULL;
+   sbox->meta            = NULL;
+   sbox->num_meta        = 0;
+   sbox->meta_size       = 0;
+   sbox->verify          = 0;
+   sbox->verified        = NULL;
+   memset(&sbox->chunks, 0, sizeof(sbox->chunks));
+   sbox->chunks.item       = NO_ITEM;
+   sbox->chunks.data_chunk = NO_ITEM;
+   sbox->io              = NULL;
+   sbox->unpacked        = NULL;
+   sbox->names           = NULL;
+   sbox->name_mask       = 0;
+   sbox->dir_image       = NULL;
+   sbox->index_io        = NULL;
+   sbox->lazy            = 0;
+   sbox->located         = 0;
+   sbox->located_max     = 0;
+   sbox->next_entry      = 0;
+   sbox->has_meta        = 0;
+   sbox->trusted         = 0;
+   sbox->memory          = 0;
+   sbox->budgeted        = 0;
+   sbox->demoted         = 0;
+   sbox->want_demoted    = 0;
+   sbox->counted         = 0;
+   sbox->budget_failed   = 0;
+   sbox->name_copy       = NULL;
+   sbox->name_max        = 0;
+   sbox->budget_prev     = NULL;
+   sbox->budget_next     = NULL;
+   sbox->original        = NULL;
+   sbox->clones          = 0;
+   sbox->names_borrowed  = 0;
+}
+
+static void sbox_free(SboxHandle *sbox)
+{
+   // a clone's directory is its original's
+   if (sbox->original) {
+      if (sbox->names_borrowed) sbox->names = NULL;
+      sbox->directory       = NULL;
+      sbox->directory_index = NULL;
+      sbox->meta            = NULL;
+      sbox->index_io        = NULL;
+   }
+   // the parts read from an index file are in its mapping
+   if (sbox->index_io) {
+      if (in_index(sbox, sbox->directory_index)) sbox->directory_index = NULL;
+      if (in_index(sbox, sbox->meta))            sbox->meta = NULL;
+      if (in_index(sbox, sbox->names))           sbox->names = NULL;
+      sbox->index_io->close(sbox->index_io);
+   }
+   if (sbox->directory)        free(sbox->directory);
+   if (sbox->directory_index)  free(sbox->directory_index);
+   if (sbox->free_me)          free(sbox->free_me);
+   if (sbox->meta)             free(sbox->meta);
+   if (sbox->chunks.end)       free(sbox->chunks.end);
+   if (sbox->chunks.data)      free(sbox->chunks.data);
+   if (sbox->verified)         free(sbox->verified);
+   if (sbox->unpacked)         free(sbox->unpacked);
+   if (sbox->names)            free(sbox->names);
+   if (sbox->name_copy)        free(sbox->name_copy);
+   sbox_initialize(sbox);
+   free(sbox);
+}
+
+SboxResultCode SboxReadClose(SboxHandle *sbox)
+{
+   if (sbox->budgeted)
+      budget_remove(sbox);
+   if (sbox->original)
+      budget_pin(sbox, 0);
+   if (sbox->close_io)
+      sbox->io->close(sbox->io);
+   sbox_free(sbox);
+   return SBOX_OK;
+}
+
+// the sbox is the 'size' bytes at 'offset' in 'io'
+static SboxResultCode open_sbox(SboxHandle **handle, SboxIO *io, int close,
+                                uint32 offset, uint32 size, char *sig,
+                                SboxReadOptions *options)
+{
+   static SboxReadOptions defaults;
+   SboxResultCode result;
+   SboxHandle *sbox;
+
+   if (options == NULL) options = &defaults;
+
+   sbox = malloc(sizeof(SboxHandle));
+   if (!sbox) {
+      if (close) io->close(io);
+      return ERROR(OOM, HANDLE_MEM);
+   }
+
+   sbox_initialize(sbox);
+
+   sbox->start    = offset;
+   sbox->length   = size;
+   sbox->io       = io;
+   sbox->close_io = close;
+
+   // a mapped block must lie inside the mapping
+   if (io->map && (offset > io->size(io) || size > io->size(io) - offset))
+      result = ERROR(HEADER, SHORT);
+   else
+      result = read_directory(sbox, sig, options);
    if (result != SBOX_OK) {
       SboxReadClose(sbox);
       return result;
    }
+   if (sbox->directory)
+      budget_add(sbox);
    *handle = sbox;
    return SBOX_OK;
 }
 
+SboxResultCode SboxReadOpenFromFileBlock(SboxHandle **handle,
+          FILE *f, uint32 offset, uint32 size, int close, char *sig)
+{
+   SboxIO *io;
+   if (f == NULL)
+      return ERROR(SBOX_INVALID_FILE_OPEN, NO_FILE);
+   io = SboxIOStdio(f, close);
+   if (io == NULL) {
+      if (close) fclose(f);
+      return ERROR(OOM, HANDLE_MEM);
+   }
+   return open_sbox(handle, io, 1, offset, size, sig, NULL);
+}
+
+// read an sBOX held in memory, which must stay there until it's closed
+SboxResultCode SboxReadOpenFromMemory(SboxHandle **handle, void *data,
+                                      uint32 size, char *sig)
+{
+   SboxIO *io;
+   if (data == NULL)
+      return ERROR(SBOX_INVALID_FILE_OPEN, NO_FILE);
+   io = SboxIOMemory(data, size);
+   if (io == NULL)
+      return ERROR(OOM, HANDLE_MEM);
+   return open_sbox(handle, io, 1, 0, size, sig, NULL);
+}
+
+// read an sBOX through an I/O backend, which is closed along with the
+// sbox if 'close' is true
+SboxResultCode SboxReadOpenIO(SboxHandle **handle, SboxIO *io, int close, char *sig)
+{
+   if (io == NULL)
+      return ERROR(SBOX_INVALID_FILE_OPEN, NO_FILE);
+   return open_sbox(handle, io, close, 0, io->size(io), sig, NULL);
+}
+
+// open the sbox stored as an item of 'parent', reading it through the
+// parent's backend, so it must be closed before the parent is; a
+// compressed one is decoded into memory of its own
+SboxResultCode SboxReadOpenNested(SboxHandle **handle, SboxHandle *parent,
+                                  uint32 item, char *sig)
+{
+   SboxResultCode result;
+   SboxItemMeta *meta;
+   unsigned char *data;
+   uint32 where, size, checked;
+   SboxIO *io;
+
+   result = SboxCheckItemRange(parent, item);
+   if (result != SBOX_OK) return result;
+   meta = find_meta(parent, item);
+
+   if (!meta || !(meta->flags & SBOX_ITEM_PACKED)) {
+      if (parent->verify && meta && (meta->flags & SBOX_ITEM_CRC)
+                         && !is_verified(parent, item)) {
+         result = SboxVerifyItem(&checked, parent, item);
+         if (result != SBOX_OK) return result;
+         set_verified(parent, item);
+      }
+      SboxItemLoc(&where, parent, item);
+      SboxItemStoredSize(&size, parent, item);
+      return open_sbox(handle, parent->io, 0, parent->start + where, size, sig, NULL);
+   }
+
+   size = meta->size;
+   data = malloc(size ? size : 1);
+   if (data == NULL)
+      return ERROR(OOM, HANDLE_MEM);
+   if (SboxReadItem(data, size, parent, item, 0) != size) {
+      free(data);
+      return ERROR(SBOX_INVALID_ITEM, CORRUPT);
+   }
+   io = SboxIOMemory(data, size);
+   if (io == NULL) {
+      free(data);
+      return ERROR(OOM, HANDLE_MEM);
+   }
+   result = open_sbox(handle, io, 1, 0, size, sig, NULL);
+   if (result != SBOX_OK)
+      free(data);
+   else
+      (*handle)->unpacked = data;
+   return result;
+}
+
+// a second handle on the same sbox, reading it through a backend of
+// its own, but borrowing everything opening it worked out from the
+// original, which must stay open until the clone is closed
+SboxResultCode SboxReadClone(SboxHandle **handle, SboxHandle *sbox)
+{
+   SboxResultCode result;
+   SboxHandle *copy;
+   SboxIO *io;
+
+   // a lazy directory is changed as it's used, so it can't be shared
+   result = lazy_finish(sbox);
+   if (result != SBOX_OK) return result;
+
+   if (sbox->io->reopen == NULL || (io = sbox->io->reopen(sbox->io)) == NULL)
+      return ERROR(SBOX_INVALID_FILE_OPEN, NO_FILE);
+   copy = malloc(sizeof(SboxHandle));
+   if (!copy) {
+      io->close(io);
+      return ERROR(OOM, HANDLE_MEM);
+   }
+   sbox_initialize(copy);
+
+   // pinned first, so the directory can't be asked to move once it's
+   // been copied
+   copy->original        = sbox;
+   budget_pin(copy, 1);
+   budget_enter(sbox);
+   copy->io              = io;
+   copy->close_io        = 1;
+   copy->start           = sbox->start;
+   copy->length          = sbox->length;
+   copy->diroff          = sbox->diroff;
+   copy->dirsize         = sbox->dirsize;
+   copy->num_items       = sbox->num_items;
+   copy->directory       = sbox->directory;
+   copy->directory_index = sbox->directory_index;
+   copy->meta            = sbox->meta;
+   copy->num_meta        = sbox->num_meta;
+   copy->meta_size       = sbox->meta_size;
+   copy->names           = sbox->names;
+   copy->names_borrowed  = sbox->names != NULL;
+   copy->name_mask       = sbox->name_mask;
+   copy->dir_image       = sbox->dir_image;
+   copy->index_io        = sbox->index_io;
+   copy->trusted         = sbox->trusted;
+   budget_leave(sbox);
+
+   result = SboxReadSetVerify(copy, sbox->verify);
+   if (result != SBOX_OK) {
+      SboxReadClose(copy);
+      return result;
+   }
+   *handle = copy;
+   return SBOX_OK;
+}
+
+// as SboxReadOpenIO(), but using the index file 'index' written by
+// SboxReadSaveIndex(), if it's there and matches the sbox
+SboxResultCode SboxReadOpenWithIndex(SboxHandle **handle, SboxIO *io, int close,
+                                     char *index, char *sig)
+{
+   SboxReadOptions options;
+   memset(&options, 0, sizeof(options));
+   options.index = index;
+   return SboxReadOpenWithOptions(handle, io, close, &options, sig);
+}
+
+// as SboxReadOpenIO(), with the choices in 'options'; NULL, or all
+// zeroes, is the same as SboxReadOpenIO()
+SboxResultCode SboxReadOpenWithOptions(SboxHandle **handle, SboxIO *io, int close,
+                                       SboxReadOptions *options, char *sig)
+{
+   if (io == NULL)
+      return ERROR(SBOX_INVALID_FILE_OPEN, NO_FILE);
+   return open_sbox(handle, io, close, 0, io->size(io), sig, options);
+}
+
 SboxResultCode SboxReadOpenFromFile(SboxHandle **handle, FILE *f, int close, char *sig)
 {
    if (f == NULL)
@@ -555,8 +2338,7 @@ SboxResultCode SboxReadOpenFilename(SboxHandle **handle, char *filename, char *s
 
 SboxResultCode SboxSignature(char *signature, SboxHandle *sbox)
 {
-   sbox_seek(sbox, 0);
-   if (fread(signature, 1, 16, sbox->f) != 16) return ERROR(HEADER, BAD_SIGNATURE);
+   if (sbox_read(sbox, 0, signature, 16) != 16) return ERROR(HEADER, BAD_SIGNATURE);
    return SBOX_OK;
 }
 
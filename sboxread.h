@@ -3,6 +3,7 @@
 
 #include <stdio.h>            // NOT_IN_SBOXLIB
 #include "sbox.h"             // NOT_IN_SBOXLIB
+#include "sboxio.h"           // NOT_IN_SBOXLIB
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +17,11 @@ extern unsigned long  sbox_max_memory_directory;
 #define SBOX_DIRECTORY_ALWAYS_IN_MEMORY    0xffffffff
 #define SBOX_DIRECTORY_NEVER_IN_MEMORY     0
 
+// a limit on the memory taken by the directories of all open sboxes
+// together; the biggest are read from their files while over it
+extern SboxResultCode SboxReadSetMemoryBudget(unsigned long budget);
+extern SboxResultCode SboxReadMemoryUsed(unsigned long *value);
+
 //////////////////////////////////////////////////////////////////////////
 
 #define SRC  SboxResultCode
@@ -28,6 +34,39 @@ extern SRC SboxReadOpenFilename(SboxHandle **handle, char *filename, char *sig);
 extern SRC SboxReadOpenFromFile(SboxHandle **handle, FILE *f, int close, char *sig);
 extern SRC SboxReadOpenFromFileBlock(SboxHandle **handle,
           FILE *f, uint32 offset, uint32 size, int close, char *sig);
+// the 'size' bytes at 'data' must stay valid until SboxReadClose()
+extern SRC SboxReadOpenFromMemory(SboxHandle **handle, void *data,
+          uint32 size, char *sig);
+// read through an I/O backend (see sboxio.h), closed with the sbox
+// if 'close' is true
+extern SRC SboxReadOpenIO(SboxHandle **handle, SboxIO *io, int close, char *sig);
+// as SboxReadOpenIO(), using an index file written by SboxReadSaveIndex()
+// if it's there and matches the sbox
+extern SRC SboxReadOpenWithIndex(SboxHandle **handle, SboxIO *io, int close,
+          char *index, char *sig);
+
+// choices made when opening an sbox; zero the whole struct, then set
+// the fields wanted, so that fields added later keep their defaults
+typedef struct
+{
+   int           lazy;         // find directory entries only as they're used
+   char         *index;        // index file to use, if it's there and matches
+   int           trusted;      // skip checking the directory; only for sboxes
+                               // from a source known to write them correctly
+   unsigned long max_memory;   // sbox_max_memory_directory for this sbox;
+                               // 0 for the global value
+} SboxReadOptions;
+
+extern SRC SboxReadOpenWithOptions(SboxHandle **handle, SboxIO *io, int close,
+          SboxReadOptions *options, char *sig);
+
+// the sbox stored as an item of 'parent'; close it before the parent
+extern SRC SboxReadOpenNested(SboxHandle **handle, SboxHandle *parent,
+          uint32 item, char *sig);
+
+// another handle on 'sbox' with a backend of its own, e.g. for another
+// thread, sharing its directory; close it before the original
+extern SRC SboxReadClone(SboxHandle **handle, SboxHandle *sbox);
 
 extern SRC SboxReadClose(SboxHandle *sbox);
 
@@ -46,19 +85,89 @@ extern SRC SboxNumItems(uint32 *value, SboxHandle *sbox);
 
 extern SRC SboxItemLoc (uint32 *value, SboxHandle *sbox, uint32 item);
 extern SRC SboxItemSize(uint32 *value, SboxHandle *sbox, uint32 item);
+extern SRC SboxItemStoredSize(uint32 *value, SboxHandle *sbox, uint32 item);
+// *value is 1 if the item is stored compressed, whatever its sizes
+extern SRC SboxItemPacked(uint32 *value, SboxHandle *sbox, uint32 item);
+// how the data is stored, for copying it as is
+extern SRC SboxItemStoredForm(SboxItemForm *form, SboxHandle *sbox, uint32 item);
 extern SRC SboxNameSize(uint32 *value, SboxHandle *sbox, uint32 item);
 
 extern SRC SboxNameData  (void **value,                 SboxHandle *sbox, uint32 item);
 extern SRC SboxNameBuffer(void *buffer, uint32 bufsize, SboxHandle *sbox, uint32 item);
 
+// every item's location, stored size and name at once; *entries has
+// one per item, *names holds the names back to back, and both are in
+// the one block free(*entries) releases
+typedef struct
+{
+   uint32 offset;             // as SboxItemLoc()
+   uint32 size;               // as SboxItemStoredSize()
+   uint32 name;               // where the name starts in *names
+   uint32 namesize;
+} SboxListEntry;
+
+extern SRC SboxListNames(char **names, SboxListEntry **entries, SboxHandle *sbox);
+
+// every item in order, reading the directory from the file in large
+// blocks, without it being held or indexed in memory (open the sbox
+// with 'lazy' for it not to be at open either)
+typedef struct st_SboxDirIter SboxDirIter;
+
+typedef struct
+{
+   uint32 item;               // SBOX_NOT_FOUND once past the last item
+   uint32 offset;             // as SboxItemLoc()
+   uint32 size;               // as SboxItemStoredSize()
+   uint32 namesize;
+   void  *name;               // good until the next call
+} SboxDirEntry;
+
+extern SRC SboxDirIterBegin(SboxDirIter **iter, SboxHandle *sbox);
+extern SRC SboxDirIterNext (SboxDirEntry *entry, SboxDirIter *iter);
+extern SRC SboxDirIterEnd  (SboxDirIter *iter);
+
+// *item is the first item with the name, or SBOX_NOT_FOUND
+#define SBOX_NOT_FOUND   ((uint32) -1)
+extern SRC SboxFindName  (uint32 *item, SboxHandle *sbox, void *name, uint32 namelen);
+// build a hash table of the names, so SboxFindName() doesn't scan the
+// directory; threads may then look names up at the same time
+extern SRC SboxReadSetNameIndex(SboxHandle *sbox, int enable);
+// write the parsed directory and name index to an index file, which
+// other processes can map and use instead of parsing the directory
+extern SRC SboxReadSaveIndex(SboxHandle *sbox, char *filename);
+
+// the item's data in place, if the sbox is in memory (opened from
+// memory, or through a mapped backend) and the item isn't compressed
+extern SRC SboxItemData  (void **value,                 SboxHandle *sbox, uint32 item);
+
+// number of bytes in the file not used by any item or by sBOX structures
+extern SRC SboxDeadSpace (uint32 *value,                SboxHandle *sbox);
+
 /////
 //
 // access values
 
 extern uint32 SboxReadItem(void *buffer, uint32 bufsize,
                              SboxHandle *sbox, uint32 item, uint32 offset);
+// as SboxReadItem(), but the bytes as stored: not decompressed or checked
+extern uint32 SboxReadStored(void *buffer, uint32 bufsize,
+                             SboxHandle *sbox, uint32 item, uint32 offset);
 extern SRC    SboxSeekItem(  SboxHandle *sbox, uint32 item, uint32 offset);
 extern FILE  *SboxFileHandle(SboxHandle *sbox);
+// copy up to 'length' bytes of an item to a file descriptor or socket,
+// inside the kernel where possible; returns the number of bytes copied
+extern uint32 SboxCopyItemToFd(SboxHandle *sbox, uint32 item,
+                               uint32 offset, uint32 length, int fd);
+
+// check an item's data against the checksum it was written with;
+// *checked is 0 if it has none, and a mismatch is SBOX_INVALID_ITEM
+extern SRC    SboxVerifyItem(uint32 *checked, SboxHandle *sbox, uint32 item);
+// have SboxReadItem() check each item the first time it's read, and
+// fail (returning 0) if the checksum doesn't match
+extern SRC    SboxReadSetVerify(SboxHandle *sbox, int enable);
+// SBOX_OK if the item's data lies between the header and the tail,
+// clear of the directory
+extern SRC    SboxCheckItemRange(SboxHandle *sbox, uint32 item);
 
 #undef SRC
 
@@ -0,0 +1,69 @@
+#ifndef INCLUDE_SBOXTHRD_H
+#define INCLUDE_SBOXTHRD_H
+
+// minimal threading primitives used internally by sboxlib;
+// like sboxtype.h, this is not part of the client interface
+//
+// thread functions are declared with SBOX_THREAD(name, arg) and
+// end with 'return 0'; sbox_thread_create() returns 0 on success
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+typedef CRITICAL_SECTION   SboxMutex;
+typedef CONDITION_VARIABLE SboxCond;
+typedef HANDLE             SboxThread;
+
+#define sbox_mutex_init(m)       InitializeCriticalSection(m)
+#define sbox_mutex_destroy(m)    DeleteCriticalSection(m)
+#define sbox_mutex_lock(m)       EnterCriticalSection(m)
+#define sbox_mutex_unlock(m)     LeaveCriticalSection(m)
+
+// a mutex for globals, which needs no initializing
+typedef SRWLOCK            SboxStaticMutex;
+#define SBOX_STATIC_MUTEX_INIT   SRWLOCK_INIT
+#define sbox_static_lock(m)      AcquireSRWLockExclusive(m)
+#define sbox_static_unlock(m)    ReleaseSRWLockExclusive(m)
+
+#define sbox_cond_init(c)        InitializeConditionVariable(c)
+#define sbox_cond_destroy(c)     ((void) 0)
+#define sbox_cond_wait(c,m)      SleepConditionVariableCS(c, m, INFINITE)
+#define sbox_cond_signal(c)      WakeConditionVariable(c)
+#define sbox_cond_broadcast(c)   WakeAllConditionVariable(c)
+
+#define SBOX_THREAD(name,arg)    static DWORD WINAPI name(LPVOID arg)
+#define sbox_thread_create(t,f,a) ((*(t) = CreateThread(NULL, 0, f, a, 0, NULL)) == NULL)
+#define sbox_thread_join(t)      (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+
+#else
+
+#include <pthread.h>
+
+typedef pthread_mutex_t    SboxMutex;
+typedef pthread_cond_t     SboxCond;
+typedef pthread_t          SboxThread;
+
+#define sbox_mutex_init(m)       pthread_mutex_init(m, NULL)
+#define sbox_mutex_destroy(m)    pthread_mutex_destroy(m)
+#define sbox_mutex_lock(m)       pthread_mutex_lock(m)
+#define sbox_mutex_unlock(m)     pthread_mutex_unlock(m)
+
+typedef pthread_mutex_t    SboxStaticMutex;
+#define SBOX_STATIC_MUTEX_INIT   PTHREAD_MUTEX_INITIALIZER
+#define sbox_static_lock(m)      pthread_mutex_lock(m)
+#define sbox_static_unlock(m)    pthread_mutex_unlock(m)
+
+#define sbox_cond_init(c)        pthread_cond_init(c, NULL)
+#define sbox_cond_destroy(c)     pthread_cond_destroy(c)
+#define sbox_cond_wait(c,m)      pthread_cond_wait(c, m)
+#define sbox_cond_signal(c)      pthread_cond_signal(c)
+#define sbox_cond_broadcast(c)   pthread_cond_broadcast(c)
+
+#define SBOX_THREAD(name,arg)    static void *name(void *arg)
+#define sbox_thread_create(t,f,a) pthread_create(t, NULL, f, a)
+#define sbox_thread_join(t)      pthread_join(t, NULL)
+
+#endif
+
+#endif
@@ -2,6 +2,8 @@
 #define INCLUDE_SBOXTYPE_H
 
 #include "sbox.h"
+#include "sboxio.h"
+#include "sboxthrd.h"
 
 typedef struct
 {
@@ -11,28 +13,148 @@ typedef struct
    unsigned char name[4];
 } SboxDirectoryItem;
 
+// attributes of items that don't fit in the directory are kept in one
+// extra item, written last and hidden by sboxread; its data is "sbMT",
+// the record size, the record count, then the records, sorted by item
+#define SBOX_META_NAME       "\0sbox-meta"
+#define SBOX_META_NAMESIZE   10
+#define SBOX_META_MAGIC      "sbMT"
+#define SBOX_META_RECORD     16
+#define SBOX_META_RECORD_MIN 12        // records without the crc field
+
+#define SBOX_ITEM_COMPRESSED 1         // data is one sboxlz block
+#define SBOX_ITEM_CHUNKED    2         // data is sboxlz chunks and a table
+#define SBOX_ITEM_PACKED     (SBOX_ITEM_COMPRESSED | SBOX_ITEM_CHUNKED)
+#define SBOX_ITEM_CRC        4         // 'crc' is the CRC32C of the data
+
+typedef struct
+{
+   uint32 item;
+   uint32 flags;
+   uint32 size;                        // size of the data once decoded
+   uint32 crc;                         // of the data as stored
+} SboxItemMeta;
+
+// the chunk layout of the compressed item read last, and the chunk of
+// it decompressed last
+typedef struct
+{
+   uint32 item;                        // item whose table is loaded
+   uint32 count;                       // number of chunks
+   uint32 size;                        // uncompressed size of each chunk
+   uint32 *end;                        // stored end offset of each chunk
+   uint32 max;                         // entries allocated in 'end'
+   unsigned char *data;                // one decompressed chunk
+   uint32 data_max;
+   uint32 data_chunk;                  // which chunk of 'item', if any
+} SboxChunkCache;
+
+// a slot in the hash table of item names
+typedef struct
+{
+   uint32 hash;
+   uint32 item;                        // 0xffffffff if the slot is empty
+} SboxNameSlot;
+
 struct st_SboxHandle
 {
-   FILE   *f;
+   SboxIO *io;                         // where the sbox is
    uint32 start;
    uint32 length;
+   uint32 diroff;                      // location of directory entries
+   uint32 dirsize;                     // size of directory entries
    uint32 num_items;                   // number of items in directory
    SboxDirectoryItem **directory;      // if we can just load it into memory
    uint32 *directory_index;            // if we have to refer to it on disk
    void   *free_me;                    // storage to free when done
-   int    close_file;                  // whether we should close the file
+   SboxItemMeta *meta;                 // attributes of some items
+   uint32 num_meta;                    // number of items with attributes
+   uint32 meta_size;                   // size of the hidden meta item
+   SboxChunkCache chunks;              // for reading compressed items
+   int    verify;                      // check CRCs on first read
+   unsigned char *verified;            // bitmap of items already checked
+   int    close_io;                    // whether we should close 'io'
+   unsigned char *unpacked;            // decoded data of a nested sbox
+   SboxNameSlot *names;                // name index, if built
+   uint32 name_mask;                   // slots in 'names', minus 1
+   unsigned char *dir_image;           // directory as stored, in memory
+   SboxIO *index_io;                   // index file the above are in
+   int    lazy;                        // entries are found as they're used
+   uint32 located;                     // entries found so far, if lazy
+   uint32 located_max;                 // entries allocated in the index
+   uint32 next_entry;                  // dir_image offset of the next one
+   int    has_meta;                    // last entry is the meta item
+   int    trusted;                     // directory is used as stored
+   unsigned long memory;               // what 'directory' takes, if counted
+   int    budgeted;                    // counted against the memory budget
+   int    demoted;                     // moved out of memory to stay in it
+   int    want_demoted;                // what the budget has asked for
+   int    counted;                     // 'memory' is counted as used
+   int    budget_failed;               // couldn't do as asked, for lack of memory
+   unsigned char *name_copy;           // the last name handed out, if budgeted
+   uint32 name_max;                    // bytes allocated for it
+   SboxMutex lock;                     // guards the directory, if budgeted
+   SboxHandle *budget_prev, *budget_next;
+   SboxHandle *original;               // what a clone was cloned from
+   uint32 clones;                      // clones borrowing the directory
+   int    names_borrowed;              // 'names' is the original's
+};
+
+// a walk through the directory in order, read in blocks
+struct st_SboxDirIter
+{
+   SboxHandle *sbox;
+   unsigned char *block;               // the directory from 'start' on
+   uint32 block_max;                   // bytes allocated; 0 if mapped
+   uint32 start;
+   uint32 filled;                      // bytes of the directory in 'block'
+   uint32 next;                        // where the next entry is
+   uint32 item;                        // and its number
 };
 
+// an index file holds a parsed directory, to be mapped and used as
+// is; all fields are little-endian uint32s: "sbIX", the version, the
+// sbox length, directory offset and size, then the counts of items,
+// directory entries, meta records and name slots, the size of the
+// meta item, and the CRC32C of the directory; then the offset of every
+// entry, the meta records, the name slots, and the directory as stored
+#define SBOX_INDEX_MAGIC     "sbIX"
+#define SBOX_INDEX_VERSION   2
+#define SBOX_INDEX_HEADER    44
+
 struct st_SboxWriteHandle
 {
-   FILE   *f;
+   SboxIO *io;                         // where the sbox goes
+   FILE   *f;                          // io->f, written sequentially
+   uint32 pos;                         // next write in 'io', if no 'f'
    uint32 start;
    uint32 cur_item;
    uint32 num_items;
-   uint32 max_items;
-   SboxDirectoryItem **directory;
-   int    close_file;                  // if we must close the file when done
+   unsigned char *directory;           // SboxDirectoryItems, back to back
+   uint32 dir_used;                    // bytes of directory in use
+   uint32 dir_max;                     // bytes of directory allocated
+   uint32 last_item;                   // directory offset of newest item
+   uint32 dir_budget;                  // spill the directory beyond this
+   uint32 spilled;                     // bytes of directory in 'spill'
+   FILE   *spill;                      // older directory entries, if any
+   uint32 align;                       // alignment of every item's data
+   uint32 next_align;                  // alignment of the next item only
+   int    close_io;                    // if we must close 'io' when done
    int    error;                       // if there was an error creating it
+   int    concurrent;                  // items are added from many threads
+   SboxMutex lock;                     // guards cur_item and directory then
+   struct st_SboxWriteBehind *behind;  // background writer, if enabled
+   struct st_SboxDedup *dedup;         // content hashes, if enabled
+   struct st_SboxCompress *compress;   // compression state, if enabled
+   uint32 chunk_size;                  // compression chunk size, 0 default
+   int    compress_threads;            // threads compressing chunks
+   SboxItemMeta *meta;                 // attributes of items written
+   uint32 num_meta;
+   uint32 max_meta;
+   int    checksums;                   // record the CRC32C of each item
+   int    crc_open;                    // current item is being checksummed
+   uint32 crc;                         // of the current item so far
+   uint32 crc_bytes;                   // bytes of it checksummed so far
 };
 
 #endif
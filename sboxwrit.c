@@ -20,8 +20,17 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#ifdef _WIN32
+#include <io.h>        // _chsize
+#else
+#include <unistd.h>    // pwrite, ftruncate
+#endif
+
 #include "sbox.h"
+#include "sboxwrit.h"
 #include "sboxtype.h"
+#include "sboxlz.h"
+#include "sboxcrc.h"
 
 /////
 //
@@ -35,7 +44,7 @@
 
 static char *magic = "sb0X";
 
-#define little_int(x)    ((((x)[3]*256+(x)[2])*256+(x)[1])*256+(x)[0])
+#define little_int(x)    (((((uint32) (x)[3])*256+(x)[2])*256+(x)[1])*256+(x)[0])
 static void make_little_int(unsigned char *buffer, uint32 value)
 {
    buffer[0] = value >>  0;
@@ -44,11 +53,37 @@ static void make_little_int(unsigned char *buffer, uint32 value)
    buffer[3] = value >> 24;
 }
 
-static int write_little_int(FILE *f, uint32 value)
+/////
+//
+// output
+//
+// The stdio backend is written sequentially through its FILE *, whose
+// position the client shares (see SboxWriteFileHandle), and which
+// would flush its buffer if we seeked before every write.  Other
+// backends are written at 'pos'.
+
+// write all of 'data' at the current position; returns 1 on success
+static int out_write(SboxWriteHandle *h, void *data, uint32 size)
+{
+   if (size == 0) return 1;
+   if (h->f)      return fwrite(data, size, 1, h->f) == 1;
+   if (!h->io->write || h->io->write(h->io, h->pos, data, size) != size)
+      return 0;
+   h->pos += size;
+   return 1;
+}
+
+// 0 on success, like fseek()
+static int out_seek(SboxWriteHandle *h, uint32 pos)
+{
+   if (h->f) return fseek(h->f, pos, SEEK_SET);
+   h->pos = pos;
+   return 0;
+}
+
+static uint32 out_tell(SboxWriteHandle *h)
 {
-   unsigned char buffer[4];
-   make_little_int(buffer, value);
-   return fwrite(buffer, 4, 1, f);
+   return h->f ? (uint32) ftell(h->f) : h->pos;
 }
 
 /////
@@ -119,46 +154,81 @@ static SboxResultCode ERROR(SboxResultCode val, int error)
 // write into the middle of a file, e.g. another
 // SBOX file
 
+static uint32 write_position(SboxWriteHandle *h);
+
 static void compute_item_offset(SboxWriteHandle *h)
 {
-   h->cur_item = ftell(h->f) - h->start;
+   h->cur_item = write_position(h) - h->start;
+}
+
+// the directory is kept in a single arena, laid out exactly as it
+// will be on disk (apart from byte order), so it costs no allocation
+// per item
+//
+// the arena starts with room for up to 3 bytes of alignment padding
+// and the directory header, and is grown to fit the tail at close, so
+// padding, header, directory and tail all go out in one fwrite
+#define DIR_PREFIX   (INTSIZE*3)
+#define DIR_SUFFIX   (INTSIZE*2)
+
+static SboxDirectoryItem *dir_item(SboxWriteHandle *h, uint32 offset)
+{
+   return (SboxDirectoryItem *) (h->directory + offset);
 }
 
-static int grow_directory(SboxWriteHandle *h)
+static int grow_directory(SboxWriteHandle *h, uint32 needed)
 {
-   SboxDirectoryItem **dir;
+   unsigned char *dir;
+   uint32 size = h->dir_max;
 
-   h->max_items *= 2;
+   while (size < needed) {
+      if (size * 2 < size) return 1;
+      size *= 2;
+   }
 
-   dir = realloc(h->directory, sizeof(h->directory[0]) * h->max_items);
+   dir = realloc(h->directory, size);
    if (!dir) return 1;
 
    h->directory = dir;
+   h->dir_max   = size;
    return 0;
 }
 
+static void encode_directory(SboxWriteHandle *h);
+static SboxResultCode spill_directory(SboxWriteHandle *h);
+
 static SboxResultCode prep_item(SboxWriteHandle *h, char *name, int namesize)
 {
-   int n;
+   SboxDirectoryItem *item;
+   uint32 size = INTSIZE*3 + ((namesize+3)&~3);
    if (h->error) return sbox_old_error;
-   if (h->num_items >= h->max_items) {
-      if (grow_directory(h)) {
+   if (h->dir_used + size < h->dir_used
+         || h->spilled + h->dir_used + size < h->spilled) {
+      h->error = 1;
+      return ERROR(OOM, DIR_MEM);
+   }
+   if (h->dir_budget && h->dir_used + size > h->dir_budget
+         && h->dir_used > DIR_PREFIX) {
+      SboxResultCode result = spill_directory(h);
+      if (result != SBOX_OK) return result;
+   }
+   if (h->dir_used + size > h->dir_max) {
+      if (grow_directory(h, h->dir_used + size)) {
          h->error = 1;
          return ERROR(OOM, DIR_MEM);
       }
    }
-   n = h->num_items;
-   h->directory[n] = malloc(INTSIZE*3 + ((namesize+3)&~3));
-   if (h->directory[n] == NULL)
-      return ERROR(OOM, DIR_MEM);
+   item = dir_item(h, h->dir_used);
 
-   h->directory[n]->offset   = h->cur_item;
-   h->directory[n]->size     = 0;
-   h->directory[n]->namesize = namesize;
-   memcpy(h->directory[n]->name, name, namesize);
+   item->offset   = h->cur_item;
+   item->size     = 0;
+   item->namesize = namesize;
+   memcpy(item->name, name, namesize);
    if (namesize & 3)
-      memset(h->directory[n]->name+namesize, 0, (-namesize) & 3);
+      memset(item->name+namesize, 0, (-namesize) & 3);
 
+   h->last_item = h->dir_used;
+   h->dir_used += size;
    ++h->num_items;
    return SBOX_OK;
 }
@@ -168,184 +238,1822 @@ static SboxResultCode prep_item(SboxWriteHandle *h, char *name, int namesize)
 // the new item
 static void end_item(SboxWriteHandle *h)
 {
-   int n = h->num_items - 1;
+   SboxDirectoryItem *item = dir_item(h, h->last_item);
    compute_item_offset(h);
-   h->directory[n]->size = h->cur_item - h->directory[n]->offset;
+   item->size = h->cur_item - item->offset;
 }
 
 // use the explicitly provided size as the size of the
 // next item
 static void early_end_item(SboxWriteHandle *h, uint32 size)
 {
-   int n = h->num_items - 1;
    h->cur_item += size;
-   h->directory[n]->size = size;
+   dir_item(h, h->last_item)->size = size;
 }
 
-SboxResultCode SboxWriteItem(SboxWriteHandle *h, char *name,
-                                    uint32 namesize, uint32 datasize)
+/////
+//
+// directory spill
+//
+// With a directory budget, the arena never grows much past the budget;
+// when the next entry wouldn't fit, every entry so far is appended to a
+// temporary file and the arena starts over.  Only the newest entry is
+// ever changed after it's added, and that happens before the next one
+// is, so the spilled entries are final.  At close they're copied back
+// in order, ahead of whatever is still in the arena.
+
+SboxResultCode SboxWriteSetDirectoryBudget(SboxWriteHandle *h, uint32 budget)
 {
-   SboxResultCode result = prep_item(h, name, namesize);
-   if (result == SBOX_OK)
-      early_end_item(h, datasize);
-   return result;
+   if (h->error) return sbox_old_error;
+   h->dir_budget = budget;
+   return SBOX_OK;
 }
 
-SboxResultCode SboxWriteStartItemNamed(SboxWriteHandle *h, char *name, int namesize)
+static SboxResultCode spill_directory(SboxWriteHandle *h)
 {
-   SboxResultCode result = prep_item(h, name, namesize);
-   return result;
+   uint32 size = h->dir_used - DIR_PREFIX;
+
+   if (!h->spill) {
+      h->spill = tmpfile();
+      if (!h->spill) {
+         h->error = 1;
+         return ERROR(DIRECTORY, NO_FILE);
+      }
+   }
+   encode_directory(h);
+   if (fwrite(h->directory + DIR_PREFIX, size, 1, h->spill) != 1) {
+      h->error = 1;
+      return ERROR(DIRECTORY, FWRITE);
+   }
+   h->spilled  += size;
+   h->dir_used  = DIR_PREFIX;
+   h->last_item = DIR_PREFIX;
+   return SBOX_OK;
 }
 
-SboxResultCode SboxWriteStartItem(SboxWriteHandle *h)
+// append the spilled entries to the sBOX
+static SboxResultCode unspill_directory(SboxWriteHandle *h)
 {
-   if (h->error) return sbox_old_error;
+   unsigned char buffer[16384];
+   uint32 left = h->spilled;
+
+   if (fflush(h->spill) != 0 || fseek(h->spill, 0, SEEK_SET) != 0)
+                                       return ERROR(DIRECTORY, FSEEK);
+   while (left > 0) {
+      uint32 n = left < sizeof(buffer) ? left : sizeof(buffer);
+      if (fread(buffer, n, 1, h->spill) != 1)
+                                       return ERROR(DIRECTORY, FREAD);
+      if (!out_write(h, buffer, n))    return ERROR(DIRECTORY, FWRITE);
+      left -= n;
+   }
    return SBOX_OK;
 }
 
-SboxResultCode SboxWriteEndItemNamed(SboxWriteHandle *h, char *name, int namesize)
+/////
+//
+// write-behind
+//
+// SboxWriteData() copies into a ring of large buffers, and a background
+// thread fwrite()s full buffers in order, so the caller only blocks on
+// the disk when every buffer is waiting to be written.  The position
+// of the FILE * then lags behind; 'pos' is where it will end up.  Each
+// buffer remembers where it goes, so the writer can back up (see dedup).
+
+typedef struct st_SboxWriteBehind
 {
-   SboxResultCode result = prep_item(h, name, namesize);
-   if (result != SBOX_OK) return result;
-   end_item(h);
-   return SBOX_OK;
+   SboxMutex  lock;
+   SboxCond   work;                    // a buffer was queued, or stop
+   SboxCond   done;                    // a buffer was written
+   SboxThread thread;
+   unsigned char **data;
+   uint32    *used;
+   uint32    *offset;                  // file position of each buffer
+   uint32     bufsize;
+   int        numbufs;
+   int        head;                    // oldest queued buffer
+   int        queued;                  // buffers waiting for the thread
+   int        cur;                     // buffer being filled
+   uint32     pos;                     // file position of end of data
+   uint32     fpos;                    // file position of the FILE *
+   int        resync;                  // FILE * was handed out; re-ftell
+   int        error;
+   int        stop;
+} SboxWriteBehind;
+
+SBOX_THREAD(behind_thread, arg)
+{
+   SboxWriteHandle *h = arg;
+   SboxWriteBehind *wb = h->behind;
+   int ok;
+
+   sbox_mutex_lock(&wb->lock);
+   for(;;) {
+      int n;
+      while (wb->queued == 0 && !wb->stop)
+         sbox_cond_wait(&wb->work, &wb->lock);
+      if (wb->queued == 0) break;
+      n = wb->head;
+      sbox_mutex_unlock(&wb->lock);
+
+      if (h->f) {
+         ok = 1;
+         if (wb->offset[n] != wb->fpos)
+            ok = fseek(h->f, wb->offset[n], SEEK_SET) == 0;
+         if (ok)
+            ok = fwrite(wb->data[n], wb->used[n], 1, h->f) == 1;
+      } else
+         ok = h->io->write && h->io->write(h->io, wb->offset[n], wb->data[n],
+                                           wb->used[n]) == wb->used[n];
+      wb->fpos = wb->offset[n] + wb->used[n];
+
+      sbox_mutex_lock(&wb->lock);
+      if (!ok) wb->error = 1;
+      wb->used[n] = 0;
+      wb->head = (wb->head + 1) % wb->numbufs;
+      --wb->queued;
+      sbox_cond_broadcast(&wb->done);
+   }
+   sbox_mutex_unlock(&wb->lock);
+   return 0;
 }
 
-SboxResultCode SboxWriteEndItem(SboxWriteHandle *h)
+// hand the buffer being filled to the thread, and wait for a free one
+static int behind_submit(SboxWriteBehind *wb)
+{
+   int error;
+   sbox_mutex_lock(&wb->lock);
+   if (wb->used[wb->cur] != 0) {
+      ++wb->queued;
+      wb->cur = (wb->cur + 1) % wb->numbufs;
+      sbox_cond_signal(&wb->work);
+   }
+   while (wb->queued == wb->numbufs)
+      sbox_cond_wait(&wb->done, &wb->lock);
+   error = wb->error;
+   sbox_mutex_unlock(&wb->lock);
+   return error;
+}
+
+// wait until everything handed to SboxWriteData() is written, and
+// leave the output position at the end of the data
+static int behind_drain(SboxWriteHandle *h)
+{
+   SboxWriteBehind *wb = h->behind;
+   int error = behind_submit(wb);
+   sbox_mutex_lock(&wb->lock);
+   while (wb->queued != 0)
+      sbox_cond_wait(&wb->done, &wb->lock);
+   error |= wb->error;
+   sbox_mutex_unlock(&wb->lock);
+   if (wb->fpos != wb->pos || !h->f) {
+      // the last thing queued was backed up over, or the thread
+      // didn't move our position
+      if (out_seek(h, wb->pos) != 0) error = 1;
+      wb->fpos = wb->pos;
+   }
+   return error;
+}
+
+static int behind_error(SboxWriteBehind *wb)
+{
+   int error;
+   sbox_mutex_lock(&wb->lock);
+   error = wb->error;
+   sbox_mutex_unlock(&wb->lock);
+   return error;
+}
+
+static void behind_free(SboxWriteBehind *wb)
+{
+   int i;
+   if (wb->data)
+      for (i=0; i < wb->numbufs; ++i)
+         free(wb->data[i]);
+   free(wb->data);
+   free(wb->used);
+   free(wb->offset);
+   free(wb);
+}
+
+static int behind_stop(SboxWriteHandle *h)
+{
+   SboxWriteBehind *wb = h->behind;
+   int error = behind_drain(h);
+   sbox_mutex_lock(&wb->lock);
+   wb->stop = 1;
+   sbox_cond_signal(&wb->work);
+   sbox_mutex_unlock(&wb->lock);
+   sbox_thread_join(wb->thread);
+   sbox_cond_destroy(&wb->work);
+   sbox_cond_destroy(&wb->done);
+   sbox_mutex_destroy(&wb->lock);
+   behind_free(wb);
+   h->behind = NULL;
+   return error;
+}
+
+SboxResultCode SboxWriteSetWriteBehind(SboxWriteHandle *h, uint32 bufsize, int numbufs)
 {
+   SboxWriteBehind *wb;
+   int i;
+
    if (h->error) return sbox_old_error;
-   end_item(h);
+   if (h->behind) return SBOX_OK;
+   if (numbufs < 2) numbufs = 2;
+   if (bufsize == 0) bufsize = 1 << 20;
+
+   wb = calloc(1, sizeof(*wb));
+   if (!wb)                                     return ERROR(OOM, HANDLE_MEM);
+   wb->data = calloc(numbufs, sizeof(wb->data[0]));
+   wb->used = calloc(numbufs, sizeof(wb->used[0]));
+   wb->offset = calloc(numbufs, sizeof(wb->offset[0]));
+   wb->numbufs = numbufs;
+   if (!wb->data || !wb->used || !wb->offset) { behind_free(wb); return ERROR(OOM, HANDLE_MEM); }
+   for (i=0; i < numbufs; ++i) {
+      wb->data[i] = malloc(bufsize);
+      if (!wb->data[i])        { behind_free(wb); return ERROR(OOM, HANDLE_MEM); }
+   }
+   wb->bufsize = bufsize;
+   wb->pos     = out_tell(h);
+   wb->fpos    = wb->pos;
+
+   sbox_mutex_init(&wb->lock);
+   sbox_cond_init(&wb->work);
+   sbox_cond_init(&wb->done);
+   h->behind = wb;
+   if (sbox_thread_create(&wb->thread, behind_thread, h)) {
+      sbox_cond_destroy(&wb->work);
+      sbox_cond_destroy(&wb->done);
+      sbox_mutex_destroy(&wb->lock);
+      behind_free(wb);
+      h->behind = NULL;
+      return ERROR(OOM, HANDLE_MEM);
+   }
    return SBOX_OK;
 }
 
-SboxResultCode SboxWriteData(SboxWriteHandle *h, void *data, uint32 datasize)
+// pick up whatever the client wrote directly to the FILE *
+static void behind_resync(SboxWriteHandle *h)
+{
+   if (h->behind->resync) {
+      h->behind->pos  = ftell(h->f);
+      h->behind->fpos = h->behind->pos;
+      h->behind->resync = 0;
+   }
+}
+
+static SboxResultCode behind_write(SboxWriteHandle *h, void *data, uint32 datasize)
 {
-   if (fwrite(data, datasize, 1, h->f) == 1)
+   SboxWriteBehind *wb = h->behind;
+   unsigned char *p = data;
+
+   behind_resync(h);
+   while (datasize > 0) {
+      uint32 n = wb->bufsize - wb->used[wb->cur];
+      if (wb->used[wb->cur] == 0)
+         wb->offset[wb->cur] = wb->pos;
+      if (n > datasize) n = datasize;
+      memcpy(wb->data[wb->cur] + wb->used[wb->cur], p, n);
+      wb->used[wb->cur] += n;
+      wb->pos  += n;
+      p        += n;
+      datasize -= n;
+      if (wb->used[wb->cur] == wb->bufsize && behind_submit(wb)) {
+         h->error = 1;
+         return ERROR(SBOX_INVALID_ITEM, FWRITE);
+      }
+   }
+   return SBOX_OK;
+}
+
+// move the end of data back to 'pos'; whatever was queued beyond it
+// is still written, and then overwritten or truncated later
+static void behind_rewind(SboxWriteHandle *h, uint32 pos)
+{
+   SboxWriteBehind *wb = h->behind;
+   uint32 used = wb->used[wb->cur];
+   behind_resync(h);
+   if (used != 0 && wb->offset[wb->cur] <= pos && pos <= wb->offset[wb->cur] + used)
+      wb->used[wb->cur] = pos - wb->offset[wb->cur];
+   else
+      wb->used[wb->cur] = 0;
+   wb->pos = pos;
+}
+
+static uint32 write_position(SboxWriteHandle *h)
+{
+   if (h->behind) {
+      behind_resync(h);
+      return h->behind->pos;
+   }
+   return out_tell(h);
+}
+
+// all item data and padding goes out through here
+static SboxResultCode write_bytes(SboxWriteHandle *h, void *data, uint32 datasize)
+{
+   if (h->behind)
+      return behind_write(h, data, datasize);
+   if (out_write(h, data, datasize))
       return SBOX_OK;
    return ERROR(SBOX_INVALID_ITEM, FWRITE);
 }
 
-static int write_header(SboxWriteHandle *h, char *signature)
+/////
+//
+// content hashing
+//
+// MurmurHash3 (x86, 128-bit variant), computed incrementally as item
+// data is written.  128 bits make accidental collisions negligible even
+// across hundreds of millions of items.
+
+typedef struct
 {
-   if (fwrite(signature, 1, 16, h->f) != 16) return 1;
-   if (fwrite(magic, 4, 1, h->f) != 1) return 1;
-   if (write_little_int(h->f, 0) != 1) return 1;
+   uint32 h[4];
+   uint32 length;
+   unsigned char tail[16];
+} SboxHash;
 
-   return 0;
+#define rotl(x,r)   (((x) << (r)) | ((x) >> (32 - (r))))
+
+static const uint32 hash_c[4] = { 0x239b961b, 0xab0e9789, 0x38b34ae5, 0xa1e38b93 };
+static const uint32 hash_r[4] = { 15, 16, 17, 18 };
+
+static void hash_init(SboxHash *hs)
+{
+   memset(hs, 0, sizeof(*hs));
 }
 
-static int write_directory_header(SboxWriteHandle *h)
+static void hash_lane(SboxHash *hs, int i, uint32 k)
 {
-   uint32 dirsize=0;
-   uint32 i;
+   k *= hash_c[i];
+   k  = rotl(k, hash_r[i]);
+   k *= hash_c[(i+1) & 3];
+   hs->h[i] ^= k;
+}
 
-   // compute dirsize
-   for (i=0; i < h->num_items; ++i)
-      dirsize += INTSIZE*3 + ((h->directory[i]->namesize + 3) & ~3);
+static void hash_block(SboxHash *hs, unsigned char *p)
+{
+   static const uint32 r[4] = { 19, 17, 15, 13 };
+   static const uint32 a[4] = { 0x561ccd1b, 0x0bcaa747, 0x96cd1c35, 0x32ac3b17 };
+   int i;
+   for (i=0; i < 4; ++i) {
+      hash_lane(hs, i, little_int(p + i*4));
+      hs->h[i] = rotl(hs->h[i], r[i]);
+      hs->h[i] += hs->h[(i+1) & 3];
+      hs->h[i] = hs->h[i]*5 + a[i];
+   }
+}
 
-   // write out the header
-   if (fwrite(magic, 4, 1, h->f)       != 1) return 1;
-   if (write_little_int(h->f, dirsize) != 1) return 1;
-   return 0;
+static void hash_update(SboxHash *hs, void *data, uint32 size)
+{
+   unsigned char *p = data;
+   uint32 have = hs->length & 15;
+   if (size == 0) return;              // 'data' may be NULL
+   hs->length += size;
+   if (have) {
+      uint32 n = 16 - have < size ? 16 - have : size;
+      memcpy(hs->tail + have, p, n);
+      p += n; size -= n;
+      if (have + n < 16) return;
+      hash_block(hs, hs->tail);
+   }
+   for (; size >= 16; p += 16, size -= 16)
+      hash_block(hs, p);
+   memcpy(hs->tail, p, size);
+}
+
+static uint32 hash_mix(uint32 h)
+{
+   h ^= h >> 16; h *= 0x85ebca6b;
+   h ^= h >> 13; h *= 0xc2b2ae35;
+   h ^= h >> 16;
+   return h;
+}
+
+static void hash_final(SboxHash *hs, uint32 out[4])
+{
+   uint32 *h = hs->h;
+   int i, have = hs->length & 15;
+
+   // the zero padding of the tail mixes in as a no-op
+   memset(hs->tail + have, 0, 16 - have);
+   if (have)
+      for (i=0; i < 4; ++i)
+         hash_lane(hs, i, little_int(hs->tail + i*4));
+
+   for (i=0; i < 4; ++i) h[i] ^= hs->length;
+   h[0] += h[1] + h[2] + h[3];
+   h[1] += h[0]; h[2] += h[0]; h[3] += h[0];
+   for (i=0; i < 4; ++i) h[i] = hash_mix(h[i]);
+   h[0] += h[1] + h[2] + h[3];
+   h[1] += h[0]; h[2] += h[0]; h[3] += h[0];
+   memcpy(out, h, sizeof(hs->h));
 }
 
-static int write_directory_item(SboxWriteHandle *h, int i)
+/////
+//
+// deduplication
+//
+// Each item's data is hashed as it is written.  When an item ends with
+// the same hash and size as an earlier one, the two are read back and
+// compared, since a hash match alone could be a collision (made on
+// purpose, even); if they're the same, its directory entry is pointed
+// at the earlier data and the file is backed up to where the item
+// started, so the copy is overwritten by whatever comes next.  Items
+// given a size up front (SboxWriteItem) are checked when the next item
+// starts.  Only data passed through SboxWriteData() is hashed; items
+// written to the FILE * directly are never deduplicated, and neither is
+// anything written to a FILE * that can't be read back.
+
+typedef struct
+{
+   uint32 hash[4];
+   uint32 size;                        // 0 for an empty slot
+   uint32 offset;
+   int    pending;                     // a concurrent item is writing it
+} SboxDedupEntry;
+
+typedef struct st_SboxDedup
+{
+   SboxHash hash;                      // of the current item
+   int      open;                      // current item is being hashed
+   uint32   hashed;                    // bytes of it hashed so far
+   uint32   item_start;                // cur_item before its padding
+   uint32   high;                      // furthest file position written
+   SboxDedupEntry *table;
+   uint32   count;
+   uint32   max;                       // power of two
+   SboxCond written;                   // a pending entry was written
+} SboxDedup;
+
+#define DEDUP_NONE      0xffffffff     // no earlier data to share
+#define DEDUP_COMPARE   65536          // bytes compared at a time
+
+static int dedup_grow(SboxDedup *dd)
 {
-   if (write_little_int(h->f, h->directory[i]->offset  ) != 1) return 1;
-   if (write_little_int(h->f, h->directory[i]->size    ) != 1) return 1;
-   if (write_little_int(h->f, h->directory[i]->namesize) != 1) return 1;
-   if (fwrite(h->directory[i]->name,
-              (h->directory[i]->namesize+3)&~3, 1, h->f) != 1) return 1;
+   SboxDedupEntry *old = dd->table, *table;
+   uint32 i, j, max = dd->max ? dd->max * 2 : 1024;
+
+   table = calloc(max, sizeof(table[0]));
+   if (!table) return 1;
+   for (i=0; i < dd->max; ++i) {
+      if (old[i].size == 0) continue;
+      j = old[i].hash[0] & (max-1);
+      while (table[j].size != 0) j = (j+1) & (max-1);
+      table[j] = old[i];
+   }
+   free(old);
+   dd->table = table;
+   dd->max   = max;
    return 0;
 }
 
-static SboxResultCode write_directory_and_tail(SboxWriteHandle *h)
+// the entry for data with this hash and size, or the empty slot for
+// it, in a table that has one
+static SboxDedupEntry *dedup_lookup(SboxDedup *dd, uint32 hash[4], uint32 size)
 {
-   uint32 i;
-   uint32 dirloc = ftell(h->f) - h->start;
+   uint32 j = hash[0] & (dd->max-1);
+   while (dd->table[j].size != 0) {
+      if (dd->table[j].size == size && !memcmp(dd->table[j].hash, hash, sizeof(dd->table[j].hash)))
+         return &dd->table[j];
+      j = (j+1) & (dd->max-1);
+   }
+   return &dd->table[j];
+}
+
+// as above, growing the table first if it's getting full; NULL if it
+// can't grow
+static SboxDedupEntry *dedup_slot(SboxDedup *dd, uint32 hash[4], uint32 size)
+{
+   if (dd->count*2 >= dd->max && dedup_grow(dd))
+      return NULL;
+   return dedup_lookup(dd, hash, size);
+}
+
+// remember data at 'offset' in the empty slot 'entry'
+static void dedup_claim(SboxDedup *dd, SboxDedupEntry *entry, uint32 hash[4],
+                        uint32 size, uint32 offset)
+{
+   memcpy(entry->hash, hash, sizeof(entry->hash));
+   entry->size    = size;
+   entry->offset  = offset;
+   entry->pending = 0;
+   ++dd->count;
+}
+
+// read back 'size' bytes written at 'offset'; returns 1 on success
+static int read_at(SboxWriteHandle *h, void *data, uint32 size, uint32 offset)
+{
+#ifdef _WIN32
+   int ok;
+#else
+   unsigned char *p = data;
+#endif
 
-   // align
-   while (dirloc & 3) {
-      char buf = 0;
-      if (fwrite(&buf, 1, 1, h->f) != 1)    return ERROR(TAIL, FWRITE);
-      ++dirloc;
+   if (!h->f)
+      return h->io->read(h->io, h->start + offset, data, size) == size;
+
+#ifdef _WIN32
+   // moves the FILE * position, which the caller puts back, or which
+   // concurrent writes don't use
+   if (h->concurrent) sbox_mutex_lock(&h->lock);
+   ok = fflush(h->f) == 0 && fseek(h->f, h->start + offset, SEEK_SET) == 0
+                          && fread(data, size, 1, h->f) == 1;
+   if (h->concurrent) sbox_mutex_unlock(&h->lock);
+   return ok;
+#else
+   // concurrent items are written around stdio, with pwrite()
+   if (!h->concurrent && fflush(h->f) != 0) return 0;
+   while (size > 0) {
+      ssize_t n = pread(fileno(h->f), p, size, (off_t) h->start + offset);
+      if (n <= 0) return 0;
+      p      += n;
+      offset += n;
+      size   -= n;
    }
+   return 1;
+#endif
+}
 
-   // directory
-   if (write_directory_header(h))      return ERROR(DIRECTORY, FWRITE);
-   for (i=0; i < h->num_items; ++i)
-      if (write_directory_item(h, i))  return ERROR(DIRECTORY, FWRITE);
+// 1 if the 'size' bytes written at 'offset' are the same as 'data', or
+// if 'data' is NULL, as those written at 'other'; 0 if they differ or
+// can't be read back
+static int dedup_same(SboxWriteHandle *h, uint32 offset, unsigned char *data,
+                      uint32 other, uint32 size)
+{
+   unsigned char *buffer;
+   uint32 done, n, max = size < DEDUP_COMPARE ? size : DEDUP_COMPARE;
+   int same = 1;
 
-   assert(((ftell(h->f) - h->start) & 3) == 0);
+   buffer = malloc(data ? max : max*2);
+   if (buffer == NULL) return 0;
+   for (done=0; done < size && same; done += n) {
+      n = size - done < max ? size - done : max;
+      if (!read_at(h, buffer, n, offset + done))
+         same = 0;
+      else if (data)
+         same = !memcmp(buffer, data + done, n);
+      else
+         same = read_at(h, buffer + max, n, other + done)
+                   && !memcmp(buffer, buffer + max, n);
+   }
+   free(buffer);
+   return same;
+}
 
-   // tail
-   if (write_little_int(h->f, dirloc) != 1) return ERROR(TAIL, FWRITE);
-   if (fwrite(magic, 4, 1, h->f)      != 1) return ERROR(TAIL, FWRITE);
+static SboxResultCode dedup_finish(SboxWriteHandle *h)
+{
+   SboxDedup *dd = h->dedup;
+   SboxDirectoryItem *item;
+   SboxDedupEntry *entry;
+   uint32 hash[4], where;
+   int same;
+
+   if (!dd || !dd->open) return SBOX_OK;
+   dd->open = 0;
+   item = dir_item(h, h->last_item);
+   if (item->size == 0 || item->size != dd->hashed) return SBOX_OK;
+
+   hash_final(&dd->hash, hash);
+   entry = dedup_slot(dd, hash, item->size);
+   if (entry == NULL) return SBOX_OK;
+   if (entry->size == 0) {
+      dedup_claim(dd, entry, hash, item->size, item->offset);
+      return SBOX_OK;
+   }
 
+   // compare with the earlier data, then return to the end of this
+   if (h->behind && behind_drain(h)) {
+      h->error = 1;
+      return ERROR(SBOX_INVALID_ITEM, FWRITE);
+   }
+   where = entry->offset;
+   same  = dedup_same(h, where, NULL, item->offset, item->size);
+   if (out_seek(h, h->start + h->cur_item) != 0) {
+      h->error = 1;
+      return ERROR(SBOX_INVALID_ITEM, FSEEK);
+   }
+   if (!same) return SBOX_OK;
+
+   // already have it; back up over this copy (and its padding)
+   if (h->start + h->cur_item > dd->high)
+      dd->high = h->start + h->cur_item;
+   if (h->behind)
+      behind_rewind(h, h->start + dd->item_start);
+   else if (out_seek(h, h->start + dd->item_start) != 0) {
+      h->error = 1;
+      return ERROR(SBOX_INVALID_ITEM, FSEEK);
+   }
+   item->offset = where;
+   h->cur_item  = dd->item_start;
    return SBOX_OK;
 }
 
-SboxResultCode SboxWriteClose(SboxWriteHandle *handle)
+static SboxResultCode dedup_begin(SboxWriteHandle *h)
 {
-   SboxResultCode result = SBOX_OK;
-   uint32 i;
-   if (!handle->error)
-      result = write_directory_and_tail(handle);
-  
-   if (handle->close_file)
-      fclose(handle->f);
+   SboxResultCode result = dedup_finish(h);
+   if (result != SBOX_OK) return result;
+   hash_init(&h->dedup->hash);
+   h->dedup->open       = 1;
+   h->dedup->hashed     = 0;
+   h->dedup->item_start = h->cur_item;
+   return SBOX_OK;
+}
 
-   if (handle->directory) {
-      for (i=0; i < handle->num_items; ++i)
-         free(handle->directory[i]);
-      free(handle->directory);
+static void dedup_free(SboxWriteHandle *h)
+{
+   sbox_cond_destroy(&h->dedup->written);
+   free(h->dedup->table);
+   free(h->dedup);
+   h->dedup = NULL;
+}
+
+SboxResultCode SboxWriteSetDedup(SboxWriteHandle *h, int enable)
+{
+   SboxResultCode result = SBOX_OK;
+   if (h->error) return sbox_old_error;
+   if (enable && !h->dedup) {
+      h->dedup = calloc(1, sizeof(*h->dedup));
+      if (!h->dedup)                       return ERROR(OOM, DIR_MEM);
+      sbox_cond_init(&h->dedup->written);
+   } else if (!enable && h->dedup) {
+      result = dedup_finish(h);
+      dedup_free(h);
    }
-    
    return result;
 }
 
-// create a new SBOX file starting at the current location of f
-SboxResultCode SboxWriteOpenFromFile(SboxWriteHandle **handle, FILE *f, int close, char *sig)
+// if backing up left stale data past the end of the sBOX, and nothing
+// but us wrote there, cut it off
+static void dedup_truncate(SboxWriteHandle *h)
 {
-   SboxWriteHandle *h;
-   if (!f)               return ERROR(SBOX_INVALID_FILE_OPEN, NO_FILE);
-   h = malloc(sizeof(SboxWriteHandle));
-   if (!h)  { fclose(f); return ERROR(OOM, HANDLE_MEM); }
+   long end;
+   if (h->dedup->high == 0) return;
+   if (!h->f) {
+      if (h->pos < h->dedup->high && h->io->truncate
+                                  && h->io->size(h->io) <= h->dedup->high
+                                  && h->io->truncate(h->io, h->pos) != 0)
+         h->error = 1;
+      return;
+   }
+   if (fflush(h->f) != 0) return;
+   end = ftell(h->f);
+   if (end < 0 || (uint32) end >= h->dedup->high) return;
+   if (fseek(h->f, 0, SEEK_END) != 0) return;
+   if ((uint32) ftell(h->f) <= h->dedup->high) {
+#ifdef _WIN32
+      _chsize(_fileno(h->f), end);
+#else
+      if (ftruncate(fileno(h->f), end) != 0) h->error = 1;
+#endif
+   }
+   fseek(h->f, end, SEEK_SET);
+}
 
-   h->f         = f;
-   h->start     = ftell(f);
-   h->num_items = 0;
-   h->max_items = 16;
-   h->close_file = close;
-   h->error     = 0;
+/////
+//
+// item attributes
+//
+// Attributes that don't fit in the directory are collected as items
+// are written, and stored in a meta item added at close, which readers
+// hide.  Items are numbered in directory order, so records are added
+// in item order.
 
-   h->directory = malloc(sizeof(h->directory[0]) * h->max_items);
-   if (!h->directory) {
-      free(h);
-      if (close) fclose(f);
-      return ERROR(OOM, DIR_MEM);
+// add attributes of the newest item; 'size' and 'crc' only mean
+// something with the flags that say so
+static SboxResultCode add_meta(SboxWriteHandle *h, uint32 flags,
+                               uint32 size, uint32 crc)
+{
+   SboxItemMeta *meta;
+   if (h->num_meta != 0 && h->meta[h->num_meta-1].item == h->num_items - 1) {
+      meta = &h->meta[h->num_meta-1];
+      meta->flags |= flags;
+      if (flags & SBOX_ITEM_PACKED) meta->size = size;
+      if (flags & SBOX_ITEM_CRC)    meta->crc  = crc;
+      return SBOX_OK;
+   }
+   if (h->num_meta == h->max_meta) {
+      uint32 max = h->max_meta ? h->max_meta * 2 : 64;
+      meta = realloc(h->meta, max * sizeof(h->meta[0]));
+      if (!meta) {
+         h->error = 1;
+         return ERROR(OOM, DIR_MEM);
+      }
+      h->meta     = meta;
+      h->max_meta = max;
+   }
+   meta = &h->meta[h->num_meta++];
+   meta->item  = h->num_items - 1;
+   meta->flags = flags;
+   meta->size  = size;
+   meta->crc   = crc;
+   return SBOX_OK;
+}
+
+static SboxResultCode write_meta_item(SboxWriteHandle *h)
+{
+   SboxResultCode result;
+   unsigned char *buffer, *p;
+   uint32 i, size = INTSIZE*3 + h->num_meta * SBOX_META_RECORD;
+
+   if (h->num_meta == 0) return SBOX_OK;
+   buffer = malloc(size);
+   if (!buffer)                        return ERROR(OOM, DIR_MEM);
+
+   memcpy(buffer, SBOX_META_MAGIC, 4);
+   make_little_int(buffer+INTSIZE  , SBOX_META_RECORD);
+   make_little_int(buffer+INTSIZE*2, h->num_meta);
+   p = buffer + INTSIZE*3;
+   for (i=0; i < h->num_meta; ++i) {
+      make_little_int(p          , h->meta[i].item );
+      make_little_int(p+INTSIZE  , h->meta[i].flags);
+      make_little_int(p+INTSIZE*2, h->meta[i].size );
+      make_little_int(p+INTSIZE*3, h->meta[i].crc  );
+      p += SBOX_META_RECORD;
    }
 
-   if (write_header(h, sig)) {
-      free(h->directory);
-      free(h);
-      if (close) fclose(f);
-      return ERROR(HEADER, FWRITE);
+   // in concurrent mode, cur_item is already past everything reserved
+   if (!h->concurrent)
+      compute_item_offset(h);
+   result = prep_item(h, SBOX_META_NAME, SBOX_META_NAMESIZE);
+   if (result == SBOX_OK) {
+      if (out_write(h, buffer, size))
+         early_end_item(h, size);
+      else
+         result = ERROR(SBOX_INVALID_ITEM, FWRITE);
    }
+   free(buffer);
+   return result;
+}
 
-   compute_item_offset(h);
+/////
+//
+// checksums
+//
+// With checksums on, the CRC32C of the data of each item, as stored
+// (so after compression), is kept with its attributes.  An item whose
+// data doesn't all go through SboxWriteData(), for instance because it
+// was written with the FILE * from SboxWriteFileHandle(), gets none.
 
-   *handle = h;
+SboxResultCode SboxWriteSetChecksums(SboxWriteHandle *h, int enable)
+{
+   if (h->error) return sbox_old_error;
+   h->checksums = enable != 0;
+   if (!enable)
+      h->crc_open = 0;
    return SBOX_OK;
 }
 
-// create a new SBOX file 
-SboxResultCode SboxWriteOpenFilename(SboxWriteHandle **handle, char *filename, char *sig)
+int SboxWriteChecksums(SboxWriteHandle *h)
 {
-   return SboxWriteOpenFromFile(handle, fopen(filename, "wb"), 1, sig);
+   return h->checksums;
 }
 
-FILE *SboxWriteFileHandle(SboxWriteHandle *sbox)
+static void checksum_begin(SboxWriteHandle *h)
+{
+   h->crc_open  = h->checksums;
+   h->crc       = 0;
+   h->crc_bytes = 0;
+}
+
+static SboxResultCode checksum_finish(SboxWriteHandle *h)
 {
+   SboxDirectoryItem *item;
+
+   if (!h->crc_open) return SBOX_OK;
+   h->crc_open = 0;
+   if (h->num_items == 0) return SBOX_OK;
+   item = dir_item(h, h->last_item);
+   if (item->size == 0 || item->size != h->crc_bytes) return SBOX_OK;
+   return add_meta(h, SBOX_ITEM_CRC, 0, h->crc);
+}
+
+/////
+//
+// compression
+//
+// While compression is on, SboxWriteData() collects the data of items
+// started with SboxWriteStartItem{Named}() in chunks of 'chunk_size'
+// bytes, which are compressed with sboxlz and written one at a time,
+// so reading part of an item only needs to decompress the chunks it
+// covers.  A chunk that doesn't get smaller is stored as is.
+//
+// An item that fits in one chunk is compressed whole (or not at all).
+// Otherwise its data is the chunks, then the stored end offset of each
+// chunk, then the chunk size, all little-endian.  Items whose size is
+// given up front are never compressed.
+
+#define SBOX_CHUNK_SIZE   65536        // default chunk size
+
+typedef struct st_SboxCompress
+{
+   unsigned char *data;                // uncompressed data of open chunk
+   uint32 used, max;
+   unsigned char *packed;              // its compressed form
+   uint32 packed_max;
+   uint32 *ends;                       // stored end of each chunk so far
+   uint32 num_chunks, max_chunks;
+   uint32 written;                     // chunks written out so far
+   struct st_SboxCompressPool *pool;   // compression threads, if any
+   uint32 chunk;                       // chunk size of the open item
+   uint32 total;                       // uncompressed size so far
+   uint32 stored;                      // stored size so far
+   int    open;                        // collecting an item's data
+} SboxCompress;
+
+static SboxResultCode item_data(SboxWriteHandle *h, void *data, uint32 datasize);
+
+static int grow_buffer(unsigned char **buffer, uint32 *max, uint32 needed)
+{
+   unsigned char *p;
+   uint32 size = *max ? *max : 4096;
+
+   while (size < needed) {
+      if (size * 2 < size) return 1;
+      size *= 2;
+   }
+   if (size == *max) return 0;
+   p = realloc(*buffer, size);
+   if (!p) return 1;
+   *buffer = p;
+   *max    = size;
+   return 0;
+}
+
+// compress one chunk into 'dest', which has room for 'size' bytes;
+// stores it as is if compressing doesn't help.  returns the stored size
+static uint32 pack_chunk(unsigned char *dest, unsigned char *src, uint32 size)
+{
+   uint32 n = size > 1 ? sbox_lz_compress(dest, size - 1, src, size) : 0;
+   if (n != 0) return n;
+   if (size != 0)                      // an empty item's 'src' may be NULL
+      memcpy(dest, src, size);
+   return size;
+}
+
+// the end offsets and chunk size that follow the chunks
+static void write_chunk_table(unsigned char *dest, uint32 *ends, uint32 count, uint32 chunk)
+{
+   uint32 i;
+   for (i=0; i < count; ++i)
+      make_little_int(dest + i*INTSIZE, ends[i]);
+   make_little_int(dest + count*INTSIZE, chunk);
+}
+
+SboxResultCode SboxWriteSetChunkSize(SboxWriteHandle *h, uint32 size)
+{
+   if (h->error) return sbox_old_error;
+   h->chunk_size = size;
+   return SBOX_OK;
+}
+
+// write out the next chunk in order, and note where it ends
+static SboxResultCode chunk_out(SboxWriteHandle *h, unsigned char *data, uint32 size)
+{
+   SboxCompress *cc = h->compress;
+   SboxResultCode result = item_data(h, data, size);
+   if (result != SBOX_OK) return result;
+   cc->stored += size;
+   cc->ends[cc->written++] = cc->stored;
+   return SBOX_OK;
+}
+
+/////
+//
+// compression workers
+//
+// With compression threads, full chunks are handed to a pool of
+// workers instead of being compressed by the caller, so compression
+// runs on as many cores as there are threads.  Up to two chunks per
+// thread are in flight; the caller writes them out in order as they
+// finish, and only waits when all of them are still being compressed.
+
+typedef struct
+{
+   unsigned char *data;                // uncompressed chunk
+   uint32 used, max;
+   unsigned char *packed;              // stored form, made by a worker
+   uint32 packed_max, size;
+   int    done;
+} SboxChunkJob;
+
+typedef struct st_SboxCompressPool
+{
+   SboxMutex  lock;
+   SboxCond   work;                    // a job was queued, or stop
+   SboxCond   done;                    // a job was finished
+   SboxThread *threads;
+   int        num_threads;
+   SboxChunkJob *jobs;
+   uint32     num_jobs;
+   uint32     submit;                  // jobs handed out, ever
+   uint32     take;                    // jobs picked up by workers
+   uint32     retire;                  // jobs written out
+   int        stop;
+} SboxCompressPool;
+
+SBOX_THREAD(compress_thread, arg)
+{
+   SboxCompressPool *cp = arg;
+
+   sbox_mutex_lock(&cp->lock);
+   for(;;) {
+      SboxChunkJob *job;
+      while (cp->take == cp->submit && !cp->stop)
+         sbox_cond_wait(&cp->work, &cp->lock);
+      if (cp->take == cp->submit) break;
+      job = &cp->jobs[cp->take++ % cp->num_jobs];
+      sbox_mutex_unlock(&cp->lock);
+
+      job->size = pack_chunk(job->packed, job->data, job->used);
+
+      sbox_mutex_lock(&cp->lock);
+      job->done = 1;
+      sbox_cond_broadcast(&cp->done);
+   }
+   sbox_mutex_unlock(&cp->lock);
+   return 0;
+}
+
+static void pool_free(SboxCompressPool *cp)
+{
+   uint32 i;
+   if (cp->jobs)
+      for (i=0; i < cp->num_jobs; ++i) {
+         free(cp->jobs[i].data);
+         free(cp->jobs[i].packed);
+      }
+   free(cp->jobs);
+   free(cp->threads);
+   free(cp);
+}
+
+static void pool_stop(SboxCompressPool *cp)
+{
+   int i;
+   sbox_mutex_lock(&cp->lock);
+   cp->stop = 1;
+   sbox_cond_broadcast(&cp->work);
+   sbox_mutex_unlock(&cp->lock);
+   for (i=0; i < cp->num_threads; ++i)
+      sbox_thread_join(cp->threads[i]);
+   sbox_cond_destroy(&cp->work);
+   sbox_cond_destroy(&cp->done);
+   sbox_mutex_destroy(&cp->lock);
+   pool_free(cp);
+}
+
+// NULL if there's no memory or no thread could be started, in which
+// case the caller compresses by itself
+static SboxCompressPool *pool_start(int threads)
+{
+   SboxCompressPool *cp = calloc(1, sizeof(*cp));
+   if (!cp) return NULL;
+   cp->num_jobs = threads * 2;
+   cp->jobs     = calloc(cp->num_jobs, sizeof(cp->jobs[0]));
+   cp->threads  = malloc(threads * sizeof(cp->threads[0]));
+   if (!cp->jobs || !cp->threads) { pool_free(cp); return NULL; }
+
+   sbox_mutex_init(&cp->lock);
+   sbox_cond_init(&cp->work);
+   sbox_cond_init(&cp->done);
+   while (cp->num_threads < threads
+          && !sbox_thread_create(&cp->threads[cp->num_threads], compress_thread, cp))
+      ++cp->num_threads;
+   if (cp->num_threads == 0) {
+      pool_stop(cp);
+      return NULL;
+   }
+   return cp;
+}
+
+// write out the oldest job, waiting for it to be compressed
+static SboxResultCode pool_retire(SboxWriteHandle *h)
+{
+   SboxCompressPool *cp = h->compress->pool;
+   SboxChunkJob *job = &cp->jobs[cp->retire % cp->num_jobs];
+
+   sbox_mutex_lock(&cp->lock);
+   while (!job->done)
+      sbox_cond_wait(&cp->done, &cp->lock);
+   sbox_mutex_unlock(&cp->lock);
+
+   job->done = 0;
+   ++cp->retire;
+   return chunk_out(h, job->packed, job->size);
+}
+
+static SboxResultCode pool_drain(SboxWriteHandle *h)
+{
+   SboxCompressPool *cp = h->compress->pool;
+   while (cp->retire != cp->submit) {
+      SboxResultCode result = pool_retire(h);
+      if (result != SBOX_OK) return result;
+   }
+   return SBOX_OK;
+}
+
+// hand the open chunk to a worker, and collect into the job's old buffer
+static SboxResultCode pool_submit(SboxWriteHandle *h)
+{
+   SboxCompress *cc = h->compress;
+   SboxCompressPool *cp = cc->pool;
+   SboxChunkJob *job;
+   unsigned char *data;
+   uint32 max;
+
+   if (cp->submit - cp->retire == cp->num_jobs) {
+      SboxResultCode result = pool_retire(h);
+      if (result != SBOX_OK) return result;
+   }
+   job = &cp->jobs[cp->submit % cp->num_jobs];
+   if (grow_buffer(&job->packed, &job->packed_max, cc->used)) {
+      h->error = 1;
+      return ERROR(OOM, HANDLE_MEM);
+   }
+
+   data      = job->data;
+   max       = job->max;
+   job->data = cc->data;
+   job->max  = cc->max;
+   job->used = cc->used;
+   cc->data  = data;
+   cc->max   = max;
+   cc->used  = 0;
+   if (grow_buffer(&cc->data, &cc->max, cc->chunk)) {
+      h->error = 1;
+      return ERROR(OOM, HANDLE_MEM);
+   }
+
+   sbox_mutex_lock(&cp->lock);
+   ++cp->submit;
+   sbox_cond_signal(&cp->work);
+   sbox_mutex_unlock(&cp->lock);
+   return SBOX_OK;
+}
+
+SboxResultCode SboxWriteSetCompressionThreads(SboxWriteHandle *h, int threads)
+{
+   if (h->error) return sbox_old_error;
+   if (threads < 0) threads = 0;
+   // the pool is (re)started by the next compressed item
+   if (h->compress && h->compress->pool && !h->compress->open) {
+      pool_stop(h->compress->pool);
+      h->compress->pool = NULL;
+   }
+   h->compress_threads = threads;
+   return SBOX_OK;
+}
+
+static void compress_begin(SboxWriteHandle *h)
+{
+   SboxCompress *cc = h->compress;
+   if (cc) {
+      if (h->compress_threads > 0 && !cc->pool)
+         cc->pool = pool_start(h->compress_threads);
+      cc->open       = 1;
+      cc->used       = 0;
+      cc->num_chunks = 0;
+      cc->written    = 0;
+      cc->total      = 0;
+      cc->stored     = 0;
+      cc->chunk      = h->chunk_size ? h->chunk_size : SBOX_CHUNK_SIZE;
+   }
+}
+
+// compress and write out the open chunk, or have a worker compress it
+static SboxResultCode compress_chunk(SboxWriteHandle *h)
+{
+   SboxCompress *cc = h->compress;
+   uint32 size;
+
+   if (cc->num_chunks == cc->max_chunks) {
+      uint32 max = cc->max_chunks ? cc->max_chunks * 2 : 64;
+      uint32 *ends = realloc(cc->ends, max * sizeof(ends[0]));
+      if (!ends) {
+         h->error = 1;
+         return ERROR(OOM, HANDLE_MEM);
+      }
+      cc->ends       = ends;
+      cc->max_chunks = max;
+   }
+   ++cc->num_chunks;
+   if (cc->pool)
+      return pool_submit(h);
+
+   if (grow_buffer(&cc->packed, &cc->packed_max, cc->used)) {
+      h->error = 1;
+      return ERROR(OOM, HANDLE_MEM);
+   }
+   size = pack_chunk(cc->packed, cc->data, cc->used);
+   cc->used = 0;
+   return chunk_out(h, cc->packed, size);
+}
+
+static SboxResultCode compress_collect(SboxWriteHandle *h, void *data, uint32 datasize)
+{
+   SboxCompress *cc = h->compress;
+   unsigned char *p = data;
+
+   if (cc->total + datasize < cc->total) {
+      h->error = 1;
+      return ERROR(SBOX_INVALID_ITEM, FWRITE);
+   }
+   if (grow_buffer(&cc->data, &cc->max, cc->chunk)) {
+      h->error = 1;
+      return ERROR(OOM, HANDLE_MEM);
+   }
+   cc->total += datasize;
+
+   while (datasize > 0) {
+      uint32 n = cc->chunk - cc->used;
+      // a full chunk waits for more data, so one-chunk items stay whole
+      if (n == 0) {
+         SboxResultCode result = compress_chunk(h);
+         if (result != SBOX_OK) return result;
+         n = cc->chunk;
+      }
+      if (n > datasize) n = datasize;
+      memcpy(cc->data + cc->used, p, n);
+      cc->used += n;
+      p        += n;
+      datasize -= n;
+   }
+   return SBOX_OK;
+}
+
+static SboxResultCode compress_finish(SboxWriteHandle *h)
+{
+   SboxCompress *cc = h->compress;
+   SboxResultCode result;
+   unsigned char *table;
+   uint32 size, count;
+
+   if (!cc || !cc->open) return SBOX_OK;
+   cc->open = 0;
+   if (h->error) return sbox_old_error;
+
+   if (cc->num_chunks == 0) {
+      // compress the item whole
+      if (grow_buffer(&cc->packed, &cc->packed_max, cc->used)) {
+         h->error = 1;
+         return ERROR(OOM, HANDLE_MEM);
+      }
+      size = pack_chunk(cc->packed, cc->data, cc->used);
+      if (size == cc->used)
+         return item_data(h, cc->data, cc->used);
+      result = add_meta(h, SBOX_ITEM_COMPRESSED, cc->used, 0);
+      if (result != SBOX_OK) return result;
+      return item_data(h, cc->packed, size);
+   }
+
+   if (cc->used != 0) {
+      result = compress_chunk(h);
+      if (result != SBOX_OK) return result;
+   }
+   if (cc->pool) {
+      result = pool_drain(h);
+      if (result != SBOX_OK) return result;
+   }
+   count = cc->num_chunks;
+   size  = (count + 1) * INTSIZE;
+   table = malloc(size);
+   if (!table) {
+      h->error = 1;
+      return ERROR(OOM, HANDLE_MEM);
+   }
+   write_chunk_table(table, cc->ends, count, cc->chunk);
+   result = add_meta(h, SBOX_ITEM_CHUNKED, cc->total, 0);
+   if (result == SBOX_OK)
+      result = item_data(h, table, size);
+   free(table);
+   return result;
+}
+
+// compress all of an item's data at once, for concurrent items; returns
+// a malloc'd buffer holding the stored form, or NULL if it isn't smaller
+static unsigned char *compress_item(unsigned char *data, uint32 size,
+                                    uint32 chunk, uint32 *stored, uint32 *flags)
+{
+   unsigned char *dest;
+   uint32 i, count, used = 0, *ends;
+
+   // flags are only set for data that's returned compressed
+   *flags = 0;
+   if (size < 2) return NULL;
+   count = size / chunk + (size % chunk != 0);
+   if (count == 1) {
+      dest = malloc(size);
+      if (!dest) return NULL;
+      *stored = pack_chunk(dest, data, size);
+      if (*stored < size) {
+         *flags = SBOX_ITEM_COMPRESSED;
+         return dest;
+      }
+      free(dest);
+      return NULL;
+   }
+
+   // the whole item in chunks, then the table
+   ends = malloc(count * sizeof(ends[0]));
+   dest = malloc(size + (count + 1) * INTSIZE);
+   if (ends && dest) {
+      for (i=0; i < count; ++i) {
+         uint32 n = i+1 < count ? chunk : size - i*chunk;
+         used += pack_chunk(dest + used, data + i*chunk, n);
+         ends[i] = used;
+      }
+      write_chunk_table(dest + used, ends, count, chunk);
+      used += (count + 1) * INTSIZE;
+   }
+   free(ends);
+   if (ends && dest && used < size) {
+      *stored = used;
+      *flags  = SBOX_ITEM_CHUNKED;
+      return dest;
+   }
+   free(dest);
+   return NULL;
+}
+
+static void compress_free(SboxWriteHandle *h)
+{
+   if (h->compress->pool)
+      pool_stop(h->compress->pool);
+   free(h->compress->data);
+   free(h->compress->packed);
+   free(h->compress->ends);
+   free(h->compress);
+   h->compress = NULL;
+}
+
+int SboxWriteCompression(SboxWriteHandle *h)
+{
+   return h->compress != NULL;
+}
+
+SboxResultCode SboxWriteSetCompression(SboxWriteHandle *h, int enable)
+{
+   SboxResultCode result = SBOX_OK;
+   if (h->error) return sbox_old_error;
+   if (enable && !h->compress) {
+      h->compress = calloc(1, sizeof(*h->compress));
+      if (!h->compress)                    return ERROR(OOM, HANDLE_MEM);
+   } else if (!enable && h->compress) {
+      // the open item is finished as it would have been
+      result = compress_finish(h);
+      compress_free(h);
+   }
+   return result;
+}
+
+/////
+//
+// item alignment
+//
+// Items can be made to start at a multiple of some alignment, measured
+// from the start of the file (not of the sBOX), so that they can be
+// mapped or read with O_DIRECT in place.  The zero padding in front of
+// an item isn't part of any item.
+
+SboxResultCode SboxWriteSetAlignment(SboxWriteHandle *h, uint32 align)
+{
+   if (h->error) return sbox_old_error;
+   h->align = align;
+   return SBOX_OK;
+}
+
+SboxResultCode SboxWriteAlignNextItem(SboxWriteHandle *h, uint32 align)
+{
+   if (h->error) return sbox_old_error;
+   h->next_align = align;
+   return SBOX_OK;
+}
+
+// how far cur_item must move for the next item to be aligned
+static uint32 item_padding(SboxWriteHandle *h)
+{
+   uint32 align = h->next_align ? h->next_align : h->align;
+   h->next_align = 0;
+   if (align <= 1) return 0;
+   return (align - (h->start + h->cur_item) % align) % align;
+}
+
+// work common to the start of every item: finish checksumming and
+// deduplicating the previous item, then pad to the requested alignment
+static SboxResultCode begin_item(SboxWriteHandle *h)
+{
+   static unsigned char zero[4096];
+   uint32 pad;
+
+   if (h->error) return sbox_old_error;
+   if (checksum_finish(h) != SBOX_OK) return sbox_old_error;
+   if (h->dedup) {
+      SboxResultCode result = dedup_begin(h);
+      if (result != SBOX_OK) return result;
+   }
+   checksum_begin(h);
+   pad = item_padding(h);
+   while (pad > 0) {
+      uint32 n = pad < sizeof(zero) ? pad : sizeof(zero);
+      SboxResultCode result = write_bytes(h, zero, n);
+      if (result != SBOX_OK) return result;
+      h->cur_item += n;
+      pad -= n;
+   }
+   return SBOX_OK;
+}
+
+SboxResultCode SboxWriteItem(SboxWriteHandle *h, char *name,
+                                    uint32 namesize, uint32 datasize)
+{
+   SboxResultCode result = begin_item(h);
+   if (result == SBOX_OK)
+      result = prep_item(h, name, namesize);
+   if (result == SBOX_OK)
+      early_end_item(h, datasize);
+   return result;
+}
+
+SboxResultCode SboxWriteStartItemNamed(SboxWriteHandle *h, char *name, int namesize)
+{
+   SboxResultCode result = begin_item(h);
+   if (result == SBOX_OK)
+      result = prep_item(h, name, namesize);
+   if (result == SBOX_OK)
+      compress_begin(h);
+   return result;
+}
+
+SboxResultCode SboxWriteStartItem(SboxWriteHandle *h)
+{
+   SboxResultCode result = begin_item(h);
+   if (result == SBOX_OK)
+      compress_begin(h);
+   return result;
+}
+
+SboxResultCode SboxWriteEndItemNamed(SboxWriteHandle *h, char *name, int namesize)
+{
+   SboxResultCode result = prep_item(h, name, namesize);
+   if (result == SBOX_OK)
+      result = compress_finish(h);
+   if (result != SBOX_OK) return result;
+   end_item(h);
+   result = checksum_finish(h);
+   if (result != SBOX_OK) return result;
+   return dedup_finish(h);
+}
+
+SboxResultCode SboxWriteEndItem(SboxWriteHandle *h)
+{
+   if (h->error) return sbox_old_error;
+   if (h->behind && behind_error(h->behind)) {
+      // report failures of the background writer at item granularity
+      h->error = 1;
+      return ERROR(SBOX_INVALID_ITEM, FWRITE);
+   }
+   if (compress_finish(h) != SBOX_OK) return sbox_old_error;
+   end_item(h);
+   if (checksum_finish(h) != SBOX_OK) return sbox_old_error;
+   return dedup_finish(h);
+}
+
+// the data of an item as stored
+static SboxResultCode item_data(SboxWriteHandle *h, void *data, uint32 datasize)
+{
+   if (h->dedup && h->dedup->open) {
+      hash_update(&h->dedup->hash, data, datasize);
+      h->dedup->hashed += datasize;
+   }
+   if (h->crc_open) {
+      h->crc = sbox_crc32c(h->crc, data, datasize);
+      h->crc_bytes += datasize;
+   }
+   return write_bytes(h, data, datasize);
+}
+
+SboxResultCode SboxWriteData(SboxWriteHandle *h, void *data, uint32 datasize)
+{
+   if (h->compress && h->compress->open)
+      return compress_collect(h, data, datasize);
+   return item_data(h, data, datasize);
+}
+
+/////
+//
+// stored items
+//
+// Items copied from another sbox as they're stored there keep their
+// encoding and checksum, which are recorded as soon as the item is
+// added; if it has no checksum and checksums are on, one is computed
+// over the stored bytes as usual.  Data shared by several items there
+// can be shared again with SboxWriteSharedItem().
+
+static SboxResultCode stored_meta(SboxWriteHandle *h, SboxItemForm *form)
+{
+   uint32 flags = form->encoding & SBOX_ITEM_PACKED;
+   if (form->has_crc) {
+      flags |= SBOX_ITEM_CRC;
+      h->crc_open = 0;
+   }
+   if (flags == 0) return SBOX_OK;
+   return add_meta(h, flags, form->size, form->crc);
+}
+
+SboxResultCode SboxWriteStartStoredItem(SboxWriteHandle *h, char *name, int namesize,
+                                                       SboxItemForm *form)
+{
+   SboxResultCode result = begin_item(h);
+   if (result == SBOX_OK)
+      result = prep_item(h, name, namesize);
+   if (result == SBOX_OK)
+      result = stored_meta(h, form);
+   return result;
+}
+
+SboxResultCode SboxWriteSharedItem(SboxWriteHandle *h, char *name, int namesize,
+                                   uint32 offset, uint32 size, SboxItemForm *form)
+{
+   SboxResultCode result;
+   SboxDirectoryItem *item;
+
+   if (h->error) return sbox_old_error;
+   if (offset + size < offset || offset + size > h->cur_item)
+      return ERROR(SBOX_INVALID_ITEM, OUT_OF_RANGE);
+   if (checksum_finish(h) != SBOX_OK) return sbox_old_error;
+   if (h->dedup && dedup_finish(h) != SBOX_OK) return sbox_old_error;
+   result = prep_item(h, name, namesize);
+   if (result != SBOX_OK) return result;
+   item = dir_item(h, h->last_item);
+   item->offset = offset;
+   item->size   = size;
+   return stored_meta(h, form);
+}
+
+SboxResultCode SboxWriteItemLoc(uint32 *value, SboxWriteHandle *h)
+{
+   if (h->error) return sbox_old_error;
+   if (h->num_items == 0) return ERROR(SBOX_INVALID_ITEM, OUT_OF_RANGE);
+   *value = dir_item(h, h->last_item)->offset;
+   return SBOX_OK;
+}
+
+/////
+//
+// concurrent writing
+//
+// In concurrent mode, complete items are added from any number of
+// threads.  Each item reserves its range of the file and its directory
+// entry under a lock, then writes its data outside the lock with
+// pwrite(), which doesn't disturb the shared file position.
+
+SboxResultCode SboxWriteSetConcurrent(SboxWriteHandle *h)
+{
+   if (h->error) return sbox_old_error;
+   if (checksum_finish(h) != SBOX_OK) return sbox_old_error;
+   if (h->dedup && dedup_finish(h) != SBOX_OK) return sbox_old_error;
+   // SboxWriteData() is no longer allowed, so write-behind is over
+   if ((h->behind && behind_stop(h)) || (h->f && fflush(h->f) != 0)) {
+      h->error = 1;
+      return ERROR(SBOX_INVALID_ITEM, FWRITE);
+   }
+   compute_item_offset(h);
+   sbox_mutex_init(&h->lock);
+   h->concurrent = 1;
+   return SBOX_OK;
+}
+
+static int write_at(SboxWriteHandle *h, void *data, uint32 datasize, uint32 offset)
+{
+#ifdef _WIN32
+   int ok;
+#else
+   unsigned char *p = data;
+#endif
+
+   // backends write at an offset anyway
+   if (!h->f)
+      return datasize == 0 || (h->io->write
+               && h->io->write(h->io, h->start + offset, data, datasize) == datasize);
+
+#ifdef _WIN32
+   // no positional write; serialize through the FILE * instead
+   sbox_mutex_lock(&h->lock);
+   ok = fseek(h->f, h->start + offset, SEEK_SET) == 0
+     && (datasize == 0 || fwrite(data, datasize, 1, h->f) == 1);
+   sbox_mutex_unlock(&h->lock);
+   return ok;
+#else
+   while (datasize > 0) {
+      ssize_t n = pwrite(fileno(h->f), p, datasize, (off_t) h->start + offset);
+      if (n <= 0) return 0;
+      p        += n;
+      offset   += n;
+      datasize -= n;
+   }
+   return 1;
+#endif
+}
+
+SboxResultCode SboxWriteConcurrentItem(SboxWriteHandle *h, char *name,
+                                     int namesize, void *data, uint32 datasize)
+{
+   SboxResultCode result;
+   SboxDedupEntry *entry = NULL;
+   uint32 offset, pad, where = DEDUP_NONE, hash[4], size = datasize, flags = 0, crc = 0;
+   unsigned char *packed = NULL;
+   int claimed = 0;
+
+   if (h->compress) {
+      packed = compress_item(data, datasize,
+                 h->chunk_size ? h->chunk_size : SBOX_CHUNK_SIZE, &datasize, &flags);
+      if (packed)
+         data = packed;
+   }
+
+   if (h->dedup && datasize != 0) {
+      SboxHash hs;
+      hash_init(&hs);
+      hash_update(&hs, data, datasize);
+      hash_final(&hs, hash);
+   }
+   if (h->checksums && datasize != 0) {
+      crc = sbox_crc32c(0, data, datasize);
+      flags |= SBOX_ITEM_CRC;
+   }
+
+   if (h->dedup && datasize != 0) {
+      // an earlier item with the same hash may still be writing its
+      // data; once it's there, compare it outside the lock
+      sbox_mutex_lock(&h->lock);
+      while ((entry = dedup_slot(h->dedup, hash, datasize)) != NULL
+                       && entry->size != 0 && entry->pending)
+         sbox_cond_wait(&h->dedup->written, &h->lock);
+      if (entry && entry->size != 0)
+         where = entry->offset;
+      sbox_mutex_unlock(&h->lock);
+      if (where != DEDUP_NONE && !dedup_same(h, where, data, 0, datasize))
+         where = DEDUP_NONE;
+   }
+
+   sbox_mutex_lock(&h->lock);
+   // the padding is never written; it reads back as zeros
+   pad = item_padding(h);
+   offset = h->cur_item + pad;
+   result = prep_item(h, name, namesize);
+   if (result == SBOX_OK && flags != 0)
+      result = add_meta(h, flags, size, crc);
+   if (result == SBOX_OK) {
+      if (where != DEDUP_NONE) {
+         // someone already wrote the same bytes
+         dir_item(h, h->last_item)->offset = where;
+         dir_item(h, h->last_item)->size   = datasize;
+      } else {
+         h->cur_item = offset;
+         dir_item(h, h->last_item)->offset = offset;
+         early_end_item(h, datasize);
+         // later items with this data wait until it's written
+         if (h->dedup && datasize != 0) {
+            entry = dedup_slot(h->dedup, hash, datasize);
+            if (entry && entry->size == 0) {
+               dedup_claim(h->dedup, entry, hash, datasize, offset);
+               entry->pending = 1;
+               claimed = 1;
+            }
+         }
+      }
+   }
+   sbox_mutex_unlock(&h->lock);
+
+   if (result == SBOX_OK && where == DEDUP_NONE
+                         && !write_at(h, data, datasize, offset)) {
+      h->error = 1;
+      result = ERROR(SBOX_INVALID_ITEM, FWRITE);
+   }
+   if (claimed) {
+      sbox_mutex_lock(&h->lock);
+      dedup_lookup(h->dedup, hash, datasize)->pending = 0;
+      sbox_cond_broadcast(&h->dedup->written);
+      sbox_mutex_unlock(&h->lock);
+   }
+   free(packed);
+   return result;
+}
+
+static int write_header(SboxWriteHandle *h, char *signature)
+{
+   unsigned char buffer[16+INTSIZE*2];
+   memcpy(buffer, signature, 16);
+   memcpy(buffer+16, magic, 4);
+   make_little_int(buffer+16+INTSIZE, 0);
+   return !out_write(h, buffer, sizeof(buffer));
+}
+
+static int little_endian_host(void)
+{
+   uint32 one = 1;
+   return *(unsigned char *) &one == 1;
+}
+
+static uint32 byte_swap(uint32 x)
+{
+   return (x >> 24) | ((x >> 8) & 0xff00) | ((x & 0xff00) << 8) | (x << 24);
+}
+
+// convert the arena to disk byte order in place; on little-endian
+// hosts the in-memory layout already is the disk layout
+static void encode_directory(SboxWriteHandle *h)
+{
+   uint32 offset = DIR_PREFIX;
+
+   if (little_endian_host()) return;
+
+   while (offset < h->dir_used) {
+      SboxDirectoryItem *item = dir_item(h, offset);
+      uint32 namesize = item->namesize;
+      item->offset   = byte_swap(item->offset  );
+      item->size     = byte_swap(item->size    );
+      item->namesize = byte_swap(item->namesize);
+      offset += INTSIZE*3 + ((namesize+3)&~3);
+   }
+}
+
+static SboxResultCode write_directory_and_tail(SboxWriteHandle *h)
+{
+   uint32 dirloc = out_tell(h) - h->start;
+   uint32 dirsize = h->spilled + h->dir_used - DIR_PREFIX;
+   uint32 pad = (0-dirloc) & 3;
+   unsigned char *p;
+
+   if (h->dir_used + DIR_SUFFIX > h->dir_max)
+      if (grow_directory(h, h->dir_used + DIR_SUFFIX))
+                                       return ERROR(OOM, DIR_MEM);
+
+   // align, then directory header
+   p = h->directory + DIR_PREFIX - INTSIZE*2 - pad;
+   memset(p, 0, pad);
+   memcpy(p + pad, magic, 4);
+   make_little_int(p + pad + INTSIZE, dirsize);
+   dirloc += pad;
+
+   // directory
+   encode_directory(h);
+
+   // tail
+   make_little_int(h->directory + h->dir_used, dirloc);
+   memcpy(h->directory + h->dir_used + INTSIZE, magic, 4);
+
+   if (h->spill) {
+      // header, spilled entries, then the rest of the arena and the tail
+      SboxResultCode result;
+      if (!out_write(h, p, pad + INTSIZE*2))
+                                       return ERROR(DIRECTORY, FWRITE);
+      result = unspill_directory(h);
+      if (result != SBOX_OK)           return result;
+      p       += pad + INTSIZE*2;
+      dirsize -= h->spilled;
+      pad      = 0;
+      if (!out_write(h, p, dirsize + DIR_SUFFIX))
+                                       return ERROR(DIRECTORY, FWRITE);
+   } else if (!out_write(h, p, pad + INTSIZE*2 + dirsize + DIR_SUFFIX))
+                                       return ERROR(DIRECTORY, FWRITE);
+
+   assert(((out_tell(h) - h->start) & 3) == 0);
+   return SBOX_OK;
+}
+
+SboxResultCode SboxWriteClose(SboxWriteHandle *handle)
+{
+   SboxResultCode result = SBOX_OK;
+   if (!handle->error)
+      result = checksum_finish(handle);
+   if (handle->dedup && !handle->error && result == SBOX_OK)
+      result = dedup_finish(handle);
+   if (handle->behind && behind_stop(handle)) {
+      handle->error = 1;
+      result = ERROR(SBOX_INVALID_ITEM, FWRITE);
+   }
+   if (handle->concurrent) {
+      // the directory goes after the last reserved range
+      sbox_mutex_destroy(&handle->lock);
+      if (out_seek(handle, handle->start + handle->cur_item) != 0)
+         result = ERROR(TAIL, FSEEK);
+   }
+   if (!handle->error && result == SBOX_OK)
+      result = write_meta_item(handle);
+   if (!handle->error && result == SBOX_OK)
+      result = write_directory_and_tail(handle);
+   if (handle->dedup) {
+      if (result == SBOX_OK)
+         dedup_truncate(handle);
+      dedup_free(handle);
+   }
+   if (handle->compress)
+      compress_free(handle);
+   free(handle->meta);
+   if (handle->spill)
+      fclose(handle->spill);
+  
+   if (handle->close_io)
+      handle->io->close(handle->io);
+
+   if (handle->directory)
+      free(handle->directory);
+    
+   return result;
+}
+
+// create a new SBOX file starting at offset 'start' of 'io'
+static SboxResultCode open_writer(SboxWriteHandle **handle, SboxIO *io,
+                                  int close, uint32 start, char *sig)
+{
+   SboxWriteHandle *h;
+   h = malloc(sizeof(SboxWriteHandle));
+   if (!h)  { if (close) io->close(io); return ERROR(OOM, HANDLE_MEM); }
+
+   h->io        = io;
+   h->f         = io->f;
+   h->pos       = start;
+   h->start     = start;
+   h->num_items = 0;
+   h->dir_used  = DIR_PREFIX;
+   h->dir_max   = 1024;
+   h->last_item = DIR_PREFIX;
+   h->dir_budget = 0;
+   h->spilled   = 0;
+   h->spill     = NULL;
+   h->align     = 0;
+   h->next_align = 0;
+   h->close_io  = close;
+   h->error     = 0;
+   h->concurrent = 0;
+   h->behind    = NULL;
+   h->dedup     = NULL;
+   h->compress  = NULL;
+   h->chunk_size = 0;
+   h->compress_threads = 0;
+   h->meta      = NULL;
+   h->num_meta  = 0;
+   h->max_meta  = 0;
+   h->checksums = 0;
+   h->crc_open  = 0;
+
+   h->directory = malloc(h->dir_max);
+   if (!h->directory) {
+      free(h);
+      if (close) io->close(io);
+      return ERROR(OOM, DIR_MEM);
+   }
+
+   if (write_header(h, sig)) {
+      free(h->directory);
+      free(h);
+      if (close) io->close(io);
+      return ERROR(HEADER, FWRITE);
+   }
+
+   compute_item_offset(h);
+
+   *handle = h;
+   return SBOX_OK;
+}
+
+// create a new SBOX file starting at the current location of f
+SboxResultCode SboxWriteOpenFromFile(SboxWriteHandle **handle, FILE *f, int close, char *sig)
+{
+   SboxIO *io;
+   if (!f)               return ERROR(SBOX_INVALID_FILE_OPEN, NO_FILE);
+   io = SboxIOStdio(f, close);
+   if (!io)  { if (close) fclose(f); return ERROR(OOM, HANDLE_MEM); }
+   return open_writer(handle, io, 1, ftell(f), sig);
+}
+
+// create a new SBOX file at the start of 'io', which is closed along
+// with the sbox if 'close' is true
+SboxResultCode SboxWriteOpenIO(SboxWriteHandle **handle, SboxIO *io, int close, char *sig)
+{
+   if (!io)              return ERROR(SBOX_INVALID_FILE_OPEN, NO_FILE);
+   return open_writer(handle, io, close, 0, sig);
+}
+
+// create a new SBOX file 
+SboxResultCode SboxWriteOpenFilename(SboxWriteHandle **handle, char *filename, char *sig)
+{
+   // opened for update too, so deduplication can read data back
+   return SboxWriteOpenFromFile(handle, fopen(filename, "w+b"), 1, sig);
+}
+
+FILE *SboxWriteFileHandle(SboxWriteHandle *sbox)
+{
+   if (!sbox->f) return NULL;
+   // with write-behind, the FILE * is only up to date once drained,
+   // and the client may then move it without telling us
+   if (sbox->behind) {
+      if (behind_drain(sbox))
+         sbox->error = 1;
+      sbox->behind->resync = 1;
+   }
    return sbox->f;
 }
@@ -3,6 +3,7 @@
 
 #include <stdio.h>      // NOT_IN_SBOXLIB
 #include "sbox.h"       // NOT_IN_SBOXLIB
+#include "sboxio.h"     // NOT_IN_SBOXLIB
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,9 +23,69 @@ extern SRC SboxWriteStartItem(SboxWriteHandle *h);
 extern SRC SboxWriteEndItemNamed(SboxWriteHandle *h, char *name, int namesize);
 extern SRC SboxWriteEndItem(SboxWriteHandle *h);
 extern SRC SboxWriteData(SboxWriteHandle *h, void *data, uint32 datasize);
+
+// copying items as they're stored elsewhere: start an item whose data,
+// given next with SboxWriteData(), is already in the form 'form' says
+// (see SboxItemStoredForm()), so it's written neither compressed nor
+// checksummed again; or add an item sharing the 'size' bytes at
+// 'offset' (from SboxWriteItemLoc()) which an earlier item wrote
+extern SRC SboxWriteStartStoredItem(SboxWriteHandle *h, char *name, int namesize,
+                                                SboxItemForm *form);
+extern SRC SboxWriteSharedItem(SboxWriteHandle *h, char *name, int namesize,
+                               uint32 offset, uint32 size, SboxItemForm *form);
+// where the data of the newest item starts, as SboxItemLoc() will report
+// it once the sbox is read; final after SboxWriteEndItem()
+extern SRC SboxWriteItemLoc(uint32 *value, SboxWriteHandle *h);
+
+// make item data start at a multiple of 'align' bytes from the start of
+// the file, either for every item or just for the next one started;
+// the padding is not counted as part of any item
+extern SRC SboxWriteSetAlignment(SboxWriteHandle *h, uint32 align);
+extern SRC SboxWriteAlignNextItem(SboxWriteHandle *h, uint32 align);
+
+// deduplication: items whose data is identical to an earlier item's
+// share the earlier data instead of storing another copy
+extern SRC SboxWriteSetDedup(SboxWriteHandle *h, int enable);
+
+// record the CRC32C of each item's data, for SboxVerifyItem()
+extern SRC SboxWriteSetChecksums(SboxWriteHandle *h, int enable);
+extern int SboxWriteChecksums(SboxWriteHandle *h);
+
+// keep at most about 'budget' bytes of directory in memory, spilling
+// older entries to a temporary file; 0 (the default) means no limit
+extern SRC SboxWriteSetDirectoryBudget(SboxWriteHandle *h, uint32 budget);
+
+// compress the data of items written with SboxWriteData() from now on;
+// readers decompress them transparently
+extern SRC SboxWriteSetCompression(SboxWriteHandle *h, int enable);
+extern int SboxWriteCompression(SboxWriteHandle *h);
+
+// compressed items are split in chunks of this many bytes (64K if 0),
+// so parts of them can be read without decompressing all of it
+extern SRC SboxWriteSetChunkSize(SboxWriteHandle *h, uint32 size);
+
+// compress chunks on this many background threads (0, the default,
+// compresses on the calling thread); output is the same either way
+extern SRC SboxWriteSetCompressionThreads(SboxWriteHandle *h, int threads);
+
+// write-behind: SboxWriteData() copies into 'numbufs' buffers of 'bufsize'
+// bytes which a background thread writes out; SboxWriteEndItem() reports
+// its errors and SboxWriteClose() waits for it to finish
+extern SRC SboxWriteSetWriteBehind(SboxWriteHandle *h, uint32 bufsize, int numbufs);
+
+// concurrent mode: after SboxWriteSetConcurrent(), any number of threads
+// may add complete items with SboxWriteConcurrentItem(); no other calls
+// but SboxWriteClose() are allowed, and the FILE * must not be touched
+extern SRC SboxWriteSetConcurrent(SboxWriteHandle *h);
+extern SRC SboxWriteConcurrentItem(SboxWriteHandle *h, char *name, int namesize,
+                                                void *data, uint32 datasize);
 extern SRC SboxWriteClose(SboxWriteHandle *handle);
 extern SRC SboxWriteOpenFromFile(SboxWriteHandle **handle, FILE *f, int close, char *signature);
 extern SRC SboxWriteOpenFilename(SboxWriteHandle **handle, char *filename, char *signature);
+// write from the start of an I/O backend (see sboxio.h), closed with
+// the sbox if 'close' is true; SboxWriteFileHandle() then returns NULL
+// unless it's a stdio backend
+extern SRC SboxWriteOpenIO(SboxWriteHandle **handle, SboxIO *io, int close, char *signature);
 
 extern FILE *SboxWriteFileHandle(SboxWriteHandle *sbox);
 